@@ -0,0 +1,587 @@
+/*
+ * gotemp-bench - measure the gotemp driver's sample path
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Reads every GoTemp device on the system, real or emulated, for a while
+ * and reports as JSON:
+ *  - how long a sample takes from the urb completion that brought it in
+ *    (its arrival_ns) to being returned by read(), as percentiles
+ *  - samples per second per device and in total
+ *  - CPU time per sample, of this reader and of the whole system
+ *  - for devices that show up while it runs, the time from us getting
+ *    the device's add uevent to its first sample reaching us
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "gotemp.h"
+
+#define CLASS_DIR	"/sys/class/gotemp"
+#define DEV_PREFIX	"gotemp"
+#define MAX_EVENTS	64
+#define READ_BATCH	64
+#define RETRY_MS	100
+#define NSEC_PER_SEC	1000000000ULL
+
+struct device {
+	struct device *next;
+	int fd;			/* -1 until the node could be opened */
+	char devname[32];	/* gotemp0 */
+	char name[64];		/* the usb interface, 1-1.2:1.0 */
+	uint64_t added_ns;	/* when it showed up, 0 if it was already here */
+	uint64_t first_ns;	/* arrival of its first sample */
+	int gone;		/* removed, don't try to open it again */
+	uint64_t samples;	/* in the measurement window */
+	uint64_t gaps;
+	uint64_t overruns;
+};
+
+static struct device *devices;
+static int epoll_fd;
+static unsigned int period_us;
+
+/* completion to read() latencies of the measurement window, in ns */
+static uint32_t *latencies;
+static size_t nr_latencies;
+static size_t max_latencies;
+static int measuring;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	/* the driver stamps samples with CLOCK_BOOTTIME too */
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int is_gotemp(const char *devname)
+{
+	size_t len = strlen(DEV_PREFIX);
+
+	return !strncmp(devname, DEV_PREFIX, len) &&
+	       devname[len] >= '0' && devname[len] <= '9';
+}
+
+/*
+ * Only devices still present, a probe plugged back in usually gets the
+ * same gotempN again and then has an entry of its own.
+ */
+static struct device *find_device(const char *devname)
+{
+	struct device *dev;
+
+	for (dev = devices; dev; dev = dev->next)
+		if (!dev->gone && !strcmp(dev->devname, devname))
+			return dev;
+	return NULL;
+}
+
+static void lookup_name(struct device *dev)
+{
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	char *base;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), CLASS_DIR "/%s/device", dev->devname);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0) {
+		snprintf(dev->name, sizeof(dev->name), "%s", dev->devname);
+		return;
+	}
+	link[len] = '\0';
+	base = strrchr(link, '/');
+	snprintf(dev->name, sizeof(dev->name), "%.63s", base ? base + 1 : link);
+}
+
+/* run every device at the period asked for, if any */
+static void set_period(struct device *dev)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (!period_us)
+		return;
+	snprintf(path, sizeof(path), CLASS_DIR "/%s/device/sampling_period",
+		 dev->devname);
+	f = fopen(path, "w");
+	if (!f)
+		return;
+	fprintf(f, "%u\n", period_us);
+	fclose(f);
+}
+
+static int open_device(struct device *dev)
+{
+	struct epoll_event ev;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/dev/%s", dev->devname);
+	dev->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (dev->fd < 0)
+		return -errno;
+
+	lookup_name(dev);
+	set_period(dev);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev->fd, &ev) < 0) {
+		close(dev->fd);
+		dev->fd = -1;
+		return -errno;
+	}
+	return 0;
+}
+
+static void add_device(const char *devname, uint64_t added_ns)
+{
+	struct device *dev;
+
+	if (find_device(devname))
+		return;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return;
+	snprintf(dev->devname, sizeof(dev->devname), "%s", devname);
+	dev->fd = -1;
+	dev->added_ns = added_ns;
+	dev->next = devices;
+	devices = dev;
+
+	open_device(dev);
+}
+
+/* gone devices stay on the list, their numbers still count */
+static void close_device(struct device *dev)
+{
+	if (dev->fd < 0)
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
+	close(dev->fd);
+	dev->fd = -1;
+}
+
+static void record_latency(uint64_t ns)
+{
+	uint32_t *bigger;
+
+	if (nr_latencies == max_latencies) {
+		max_latencies = max_latencies ? max_latencies * 2 : 65536;
+		bigger = realloc(latencies, max_latencies * sizeof(*latencies));
+		if (!bigger) {
+			fprintf(stderr, "out of memory for latencies\n");
+			exit(1);
+		}
+		latencies = bigger;
+	}
+	latencies[nr_latencies++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+/* returns 0 when drained, -1 when the device went away */
+static int drain_device(struct device *dev)
+{
+	struct gotemp_sample samples[READ_BATCH];
+	uint64_t now;
+	ssize_t len;
+	size_t i;
+
+	for (;;) {
+		len = read(dev->fd, samples, sizeof(samples));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -1;
+		}
+		now = now_ns();
+
+		for (i = 0; i < len / sizeof(samples[0]); ++i) {
+			struct gotemp_sample *s = &samples[i];
+
+			if (!dev->first_ns)
+				dev->first_ns = s->arrival_ns;
+			if (!measuring)
+				continue;
+
+			dev->samples++;
+			if (s->flags & GOTEMP_SAMPLE_GAP)
+				dev->gaps++;
+			if (s->flags & GOTEMP_SAMPLE_OVERRUN)
+				dev->overruns++;
+			record_latency(now > s->arrival_ns ?
+				       now - s->arrival_ns : 0);
+		}
+
+		if (len < (ssize_t)sizeof(samples))
+			return 0;
+	}
+}
+
+static void scan_devices(void)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(CLASS_DIR);
+	if (!dir)
+		return;
+	while ((de = readdir(dir)))
+		if (is_gotemp(de->d_name))
+			add_device(de->d_name, 0);
+	closedir(dir);
+}
+
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* kernel events */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * The char device is registered from the driver's probe, so its add
+ * event is as close to probe time as userspace gets to see, but it is
+ * stamped when we receive it, after however long it took to get here.
+ */
+static void handle_uevents(int fd)
+{
+	char buf[4096];
+	const char *action, *subsystem, *devname;
+	struct device *dev;
+	uint64_t now;
+	ssize_t len;
+	char *p;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		now = now_ns();
+		buf[len] = '\0';
+		action = subsystem = devname = NULL;
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strncmp(p, "ACTION=", 7))
+				action = p + 7;
+			else if (!strncmp(p, "SUBSYSTEM=", 10))
+				subsystem = p + 10;
+			else if (!strncmp(p, "DEVNAME=", 8))
+				devname = p + 8;
+		}
+		if (!action || !subsystem || !devname ||
+		    strcmp(subsystem, "gotemp") || !is_gotemp(devname))
+			continue;
+
+		if (!strcmp(action, "add")) {
+			add_device(devname, now);
+		} else if (!strcmp(action, "remove")) {
+			dev = find_device(devname);
+			if (dev) {
+				close_device(dev);
+				dev->gone = 1;
+			}
+		}
+	}
+}
+
+static int retry_pending(void)
+{
+	struct device *dev;
+	int pending = 0;
+
+	for (dev = devices; dev; dev = dev->next)
+		if (dev->fd < 0 && !dev->first_ns && !dev->gone &&
+		    open_device(dev) < 0)
+			pending = 1;
+	return pending;
+}
+
+static unsigned int nr_started(void)
+{
+	struct device *dev;
+	unsigned int n = 0;
+
+	for (dev = devices; dev; dev = dev->next)
+		if (dev->first_ns)
+			n++;
+	return n;
+}
+
+/* CPU time the whole system spent not idle, from /proc/stat */
+static uint64_t system_busy_ns(void)
+{
+	unsigned long long v[8] = { 0 };
+	uint64_t busy;
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+		   &v[7]) < 4) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	/* user nice system idle iowait irq softirq steal */
+	busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+	return busy * (NSEC_PER_SEC / sysconf(_SC_CLK_TCK));
+}
+
+static uint64_t self_cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NSEC_PER_SEC +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank */
+static uint32_t percentile(double p)
+{
+	size_t rank;
+
+	if (!nr_latencies)
+		return 0;
+	rank = (size_t)(p / 100.0 * nr_latencies + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > nr_latencies)
+		rank = nr_latencies;
+	return latencies[rank - 1];
+}
+
+static void report(FILE *out, uint64_t start, uint64_t end,
+		   uint64_t self_cpu, uint64_t system_cpu)
+{
+	double seconds = (end - start) / 1e9;
+	struct device *dev;
+	uint64_t total = 0;
+	unsigned int nr = 0;
+	const char *sep = "";
+
+	for (dev = devices; dev; dev = dev->next) {
+		total += dev->samples;
+		nr++;
+	}
+	qsort(latencies, nr_latencies, sizeof(*latencies), cmp_u32);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"duration_s\": %.3f,\n", seconds);
+	fprintf(out, "  \"devices\": %u,\n", nr);
+	fprintf(out, "  \"samples\": %llu,\n", (unsigned long long)total);
+	fprintf(out, "  \"samples_per_s\": %.1f,\n", total / seconds);
+	fprintf(out, "  \"latency_ns\": {\n");
+	fprintf(out, "    \"count\": %zu,\n", nr_latencies);
+	fprintf(out, "    \"min\": %u,\n", percentile(0));
+	fprintf(out, "    \"p50\": %u,\n", percentile(50));
+	fprintf(out, "    \"p90\": %u,\n", percentile(90));
+	fprintf(out, "    \"p99\": %u,\n", percentile(99));
+	fprintf(out, "    \"p99.9\": %u,\n", percentile(99.9));
+	fprintf(out, "    \"max\": %u\n", percentile(100));
+	fprintf(out, "  },\n");
+	fprintf(out, "  \"cpu_ns_per_sample\": {\n");
+	fprintf(out, "    \"reader\": %.0f,\n",
+		total ? (double)self_cpu / total : 0.0);
+	fprintf(out, "    \"system\": %.0f\n",
+		total ? (double)system_cpu / total : 0.0);
+	fprintf(out, "  },\n");
+	fprintf(out, "  \"per_device\": [");
+	for (dev = devices; dev; dev = dev->next) {
+		fprintf(out, "%s\n    { \"device\": \"%s\", \"samples\": %llu,"
+			" \"samples_per_s\": %.1f, \"gaps\": %llu,"
+			" \"overruns\": %llu, \"add_to_first_sample_ns\": ",
+			sep, dev->name, (unsigned long long)dev->samples,
+			dev->samples / seconds,
+			(unsigned long long)dev->gaps,
+			(unsigned long long)dev->overruns);
+		if (dev->added_ns && dev->first_ns > dev->added_ns)
+			fprintf(out, "%llu }", (unsigned long long)
+				(dev->first_ns - dev->added_ns));
+		else
+			fprintf(out, "null }");
+		sep = ",";
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-n devices] [-w seconds] [-p period_us]"
+		" [-o file]\n"
+		"  -t  how long to measure for (10)\n"
+		"  -n  wait for this many devices to deliver before starting\n"
+		"  -w  how long to wait for them at most (30)\n"
+		"  -p  set every device's sampling_period first\n"
+		"  -o  write the JSON there instead of stdout\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev;
+	struct device *dev;
+	unsigned int duration = 10;
+	unsigned int wait_for = 0;
+	unsigned int wait_max = 30;
+	const char *output = NULL;
+	uint64_t begin, start = 0, end = 0;
+	uint64_t self_cpu = 0, system_cpu = 0;
+	int uevent_fd;
+	int uevents;
+	int pending;
+	int timeout;
+	int n, i, opt;
+	FILE *out = stdout;
+
+	while ((opt = getopt(argc, argv, "t:n:w:p:o:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			wait_for = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			wait_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			period_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc || !duration) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	uevent_fd = open_uevent_socket();
+	if (uevent_fd < 0) {
+		perror("uevent socket");
+		return 1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &ev);
+
+	scan_devices();
+	pending = retry_pending();
+	begin = now_ns();
+
+	for (;;) {
+		uint64_t now = now_ns();
+
+		if (!measuring &&
+		    (nr_started() >= (wait_for ? wait_for : 1) ||
+		     now - begin >= wait_max * NSEC_PER_SEC)) {
+			if (wait_for && nr_started() < wait_for)
+				fprintf(stderr, "only %u of %u devices"
+					" delivered, measuring anyway\n",
+					nr_started(), wait_for);
+			measuring = 1;
+			start = now;
+			self_cpu = self_cpu_ns();
+			system_cpu = system_busy_ns();
+		}
+		if (measuring && now - start >= duration * NSEC_PER_SEC)
+			break;
+
+		timeout = measuring ?
+			  (int)((start + duration * NSEC_PER_SEC - now) /
+				1000000) + 1 : RETRY_MS;
+		if (pending && timeout > RETRY_MS)
+			timeout = RETRY_MS;
+
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return 1;
+		}
+
+		uevents = 0;
+		for (i = 0; i < n; ++i) {
+			dev = events[i].data.ptr;
+			if (!dev) {
+				uevents = 1;
+				continue;
+			}
+			if (drain_device(dev) < 0 ||
+			    (events[i].events & (EPOLLHUP | EPOLLERR))) {
+				drain_device(dev);
+				close_device(dev);
+			}
+		}
+		if (uevents)
+			handle_uevents(uevent_fd);
+
+		pending = retry_pending();
+	}
+
+	end = now_ns();
+	self_cpu = self_cpu_ns() - self_cpu;
+	system_cpu = system_busy_ns() - system_cpu;
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			perror(output);
+			return 1;
+		}
+	}
+	report(out, start, end, self_cpu, system_cpu);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
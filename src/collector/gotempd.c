@@ -0,0 +1,320 @@
+/*
+ * gotempd - collect samples from every GoTemp device on the system
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Every sample the driver queues up on /dev/gotempN is printed as one
+ * line of key=value pairs.  Devices are found at startup through sysfs
+ * and then followed through the kernel's hotplug events, and all of them
+ * are waited on with a single epoll set, so the daemon only wakes up
+ * when there is data to print.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "gotemp.h"
+
+#define CLASS_DIR	"/sys/class/gotemp"
+#define DEV_PREFIX	"gotemp"
+#define MAX_EVENTS	64
+#define READ_BATCH	64
+#define RETRY_MS	500
+
+struct device {
+	struct device *next;
+	int fd;			/* -1 until the node could be opened */
+	char devname[32];	/* gotemp0 */
+	char name[64];		/* the usb interface, 1-1.2:1.0 */
+};
+
+static struct device *devices;
+static int epoll_fd;
+
+static int is_gotemp(const char *devname)
+{
+	size_t len = strlen(DEV_PREFIX);
+
+	/* gotempN, but not gotemp_snapshot */
+	return !strncmp(devname, DEV_PREFIX, len) &&
+	       devname[len] >= '0' && devname[len] <= '9';
+}
+
+static struct device *find_device(const char *devname)
+{
+	struct device *dev;
+
+	for (dev = devices; dev; dev = dev->next)
+		if (!strcmp(dev->devname, devname))
+			return dev;
+	return NULL;
+}
+
+/* the interface the char device belongs to names the device in the output */
+static void lookup_name(struct device *dev)
+{
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	char *base;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), CLASS_DIR "/%s/device", dev->devname);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0) {
+		snprintf(dev->name, sizeof(dev->name), "%s", dev->devname);
+		return;
+	}
+	link[len] = '\0';
+	base = strrchr(link, '/');
+	snprintf(dev->name, sizeof(dev->name), "%.63s", base ? base + 1 : link);
+}
+
+static int open_device(struct device *dev)
+{
+	struct epoll_event ev;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/dev/%s", dev->devname);
+	dev->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (dev->fd < 0)
+		return -errno;
+
+	lookup_name(dev);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev->fd, &ev) < 0) {
+		close(dev->fd);
+		dev->fd = -1;
+		return -errno;
+	}
+
+	printf("event=add device=%s node=%s\n", dev->name, dev->devname);
+	return 0;
+}
+
+static void add_device(const char *devname)
+{
+	struct device *dev;
+
+	if (find_device(devname))
+		return;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return;
+	snprintf(dev->devname, sizeof(dev->devname), "%s", devname);
+	dev->fd = -1;
+	dev->next = devices;
+	devices = dev;
+
+	/* udev may not have created the node yet, then we retry later */
+	open_device(dev);
+}
+
+static void remove_device(struct device *dev)
+{
+	struct device **p;
+
+	for (p = &devices; *p; p = &(*p)->next) {
+		if (*p == dev) {
+			*p = dev->next;
+			break;
+		}
+	}
+
+	if (dev->fd >= 0) {
+		printf("event=remove device=%s node=%s\n", dev->name,
+		       dev->devname);
+		close(dev->fd);
+	}
+	free(dev);
+}
+
+/* returns 0 when drained, -1 when the device went away */
+static int drain_device(struct device *dev)
+{
+	struct gotemp_sample samples[READ_BATCH];
+	ssize_t len;
+	size_t i;
+
+	for (;;) {
+		len = read(dev->fd, samples, sizeof(samples));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -1;
+		}
+
+		for (i = 0; i < len / sizeof(samples[0]); ++i) {
+			struct gotemp_sample *s = &samples[i];
+
+			printf("device=%s seq=%u ts_ns=%llu raw=%d mC=%d"
+			       " counter=%u flags=%u\n",
+			       dev->name, s->sequence,
+			       (unsigned long long)s->timestamp_ns, s->raw,
+			       s->mdeg, s->rolling_counter, s->flags);
+		}
+
+		if (len < (ssize_t)sizeof(samples))
+			return 0;
+	}
+}
+
+static void scan_devices(void)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(CLASS_DIR);
+	if (!dir)
+		return;
+	while ((de = readdir(dir)))
+		if (is_gotemp(de->d_name))
+			add_device(de->d_name);
+	closedir(dir);
+}
+
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* kernel events */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* a uevent is a header followed by NUL separated KEY=value pairs */
+static void handle_uevents(int fd)
+{
+	char buf[4096];
+	const char *action, *subsystem, *devname;
+	struct device *dev;
+	ssize_t len;
+	char *p;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		action = subsystem = devname = NULL;
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strncmp(p, "ACTION=", 7))
+				action = p + 7;
+			else if (!strncmp(p, "SUBSYSTEM=", 10))
+				subsystem = p + 10;
+			else if (!strncmp(p, "DEVNAME=", 8))
+				devname = p + 8;
+		}
+		if (!action || !subsystem || !devname ||
+		    strcmp(subsystem, "gotemp") || !is_gotemp(devname))
+			continue;
+
+		if (!strcmp(action, "add")) {
+			add_device(devname);
+		} else if (!strcmp(action, "remove")) {
+			dev = find_device(devname);
+			if (dev)
+				remove_device(dev);
+		}
+	}
+}
+
+static int retry_pending(void)
+{
+	struct device *dev;
+	int pending = 0;
+
+	for (dev = devices; dev; dev = dev->next)
+		if (dev->fd < 0 && open_device(dev) < 0)
+			pending = 1;
+	return pending;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev;
+	struct device *dev;
+	int uevent_fd;
+	int uevents;
+	int pending;
+	int n, i;
+
+	if (argc > 1) {
+		fprintf(stderr, "usage: %s\n", argv[0]);
+		return 1;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	/* listen before scanning, so nothing plugged in between is missed */
+	uevent_fd = open_uevent_socket();
+	if (uevent_fd < 0) {
+		perror("uevent socket");
+		return 1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &ev);
+
+	scan_devices();
+	pending = retry_pending();
+	fflush(stdout);
+
+	for (;;) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS,
+			       pending ? RETRY_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return 1;
+		}
+
+		uevents = 0;
+		for (i = 0; i < n; ++i) {
+			dev = events[i].data.ptr;
+			if (!dev) {
+				uevents = 1;
+				continue;
+			}
+			if (drain_device(dev) < 0 ||
+			    (events[i].events & (EPOLLHUP | EPOLLERR))) {
+				/* the driver says -ENODEV once it is empty */
+				drain_device(dev);
+				remove_device(dev);
+			}
+		}
+
+		/* only now, a remove event frees devices the batch points to */
+		if (uevents)
+			handle_uevents(uevent_fd);
+
+		pending = retry_pending();
+		fflush(stdout);
+	}
+}
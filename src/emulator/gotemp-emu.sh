@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Plug in (or pull out) some emulated gotemp devices.
+#
+#	gotemp-emu.sh start N [attribute=value ...]
+#	gotemp-emu.sh stop
+#
+# The attributes are the ones in the function's configfs directory,
+# period_us, waveform and so on, and apply to all N devices.
+
+CONFIGFS=/sys/kernel/config/usb_gadget
+HERE=$(dirname "$0")
+
+start()
+{
+	count=${1:-1}
+	[ $# -gt 0 ] && shift
+
+	modprobe libcomposite || exit 1
+	modprobe dummy_hcd num="$count" || exit 1
+	if ! grep -q '^usb_f_gotemp ' /proc/modules; then
+		insmod "$HERE/usb_f_gotemp.ko" || exit 1
+	fi
+
+	i=0
+	while [ "$i" -lt "$count" ]; do
+		g=$CONFIGFS/gotemp$i
+		mkdir "$g" || exit 1
+		echo 0x08f7 > "$g/idVendor"
+		echo 0x0002 > "$g/idProduct"
+		echo high-speed > "$g/max_speed"
+		mkdir "$g/strings/0x409"
+		echo "Vernier Software & Technology" > "$g/strings/0x409/manufacturer"
+		echo "Go! Temp" > "$g/strings/0x409/product"
+		printf "EMU%05d\n" "$i" > "$g/strings/0x409/serialnumber"
+
+		mkdir "$g/configs/c.1"
+		echo 100 > "$g/configs/c.1/MaxPower"
+		mkdir "$g/functions/gotemp.0"
+		echo "$i" > "$g/functions/gotemp.0/serial"
+		for attr in "$@"; do
+			echo "${attr#*=}" > "$g/functions/gotemp.0/${attr%%=*}" || exit 1
+		done
+		ln -s "$g/functions/gotemp.0" "$g/configs/c.1/"
+
+		echo "dummy_udc.$i" > "$g/UDC"
+		i=$((i + 1))
+	done
+}
+
+stop()
+{
+	for g in "$CONFIGFS"/gotemp*; do
+		[ -d "$g" ] || continue
+		echo "" > "$g/UDC"
+		rm "$g/configs/c.1/gotemp.0"
+		rmdir "$g/configs/c.1"
+		rmdir "$g/functions/gotemp.0"
+		rmdir "$g/strings/0x409"
+		rmdir "$g"
+	done
+	rmmod usb_f_gotemp dummy_hcd 2>/dev/null
+	true
+}
+
+case "$1" in
+start)
+	shift
+	start "$@"
+	;;
+stop)
+	stop
+	;;
+*)
+	echo "usage: $0 start N [attribute=value ...] | stop" >&2
+	exit 1
+	;;
+esac
@@ -0,0 +1,861 @@
+/*
+ * GoTemp emulator - a USB gadget function that looks like a Vernier
+ * Go!Temp probe, so the gotemp driver can be run without one
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/fixp-arith.h>
+#include <linux/configfs.h>
+#include <linux/unaligned.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/composite.h>
+
+/*
+ * The protocol, as the driver speaks it.  Commands come in as 8 byte
+ * SET_REPORT control requests; measurements and command responses go
+ * out on the one interrupt IN endpoint.
+ */
+#define GOTEMP_PACKET_SIZE		8
+#define GOTEMP_SET_REPORT		0x09
+
+#define CMD_ID_GET_STATUS			0x10
+#define CMD_ID_WRITE_LOCAL_NV_MEM_1BYTE		0x11
+#define CMD_ID_WRITE_LOCAL_NV_MEM_6BYTES	0x16
+#define CMD_ID_READ_LOCAL_NV_MEM		0x17
+#define CMD_ID_START_MEASUREMENTS		0x18
+#define CMD_ID_STOP_MEASUREMENTS		0x19
+#define CMD_ID_INIT				0x1A
+#define CMD_ID_SET_MEASUREMENT_PERIOD		0x1B
+#define CMD_ID_GET_MEASUREMENT_PERIOD		0x1C
+#define CMD_ID_SET_LED_STATE			0x1D
+#define CMD_ID_GET_LED_STATE			0x1E
+#define CMD_ID_GET_SERIAL_NUMBER		0x20
+
+struct output_packet {
+	u8	cmd;
+	u8	params[7];
+} __attribute__ ((packed));
+
+#define MAX_MEASUREMENTS_IN_PACKET	3
+
+struct measurement_packet {
+	u8	measurements_in_packet;
+	u8	rolling_counter;
+	__le16	measurements[MAX_MEASUREMENTS_IN_PACKET];
+} __attribute__ ((packed));
+
+#define PACKET_TYPE_CMD_RESPONSE	0x80
+
+struct response_packet {
+	u8	header;
+	u8	cmd;
+	u8	status;
+	u8	data[5];
+} __attribute__ ((packed));
+
+#define RESPONSE_STATUS_ERROR		0x01
+
+/* the measurement period is counted in ticks of 21.333us */
+#define GOTEMP_TICKS_PER_SEC		46875
+/* the fastest the emulator goes, whatever the host asks for */
+#define GOTEMP_MIN_PERIOD_US		1000
+
+/* the sensor's DDS record, with its calibration */
+#define GOTEMP_NV_MEM_SIZE		128
+#define DDS_LONG_NAME			8
+#define DDS_SHORT_NAME			28
+#define DDS_CAL_EQUATION		58
+#define DDS_CAL_PAGES			70
+#define DDS_CHECKSUM			127
+
+/* interrupt requests kept queued, and responses waiting to go out */
+#define GOTEMP_NR_REQS			4
+#define GOTEMP_NR_RESPONSES		16
+
+enum gotemp_waveform {
+	WAVE_CONSTANT,
+	WAVE_SINE,
+	WAVE_RAMP,
+	WAVE_SQUARE,
+};
+
+static const char * const waveform_names[] = {
+	[WAVE_CONSTANT] =	"constant",
+	[WAVE_SINE] =		"sine",
+	[WAVE_RAMP] =		"ramp",
+	[WAVE_SQUARE] =		"square",
+};
+
+/* everything that can be set through configfs */
+struct gotemp_params {
+	u32	period_us;		/* until the host sets one */
+	u32	waveform;
+	s32	base_mdeg;
+	u32	amplitude_mdeg;
+	u32	wave_period_ms;
+	u32	noise_mdeg;
+	u32	gap_every;		/* drop every Nth packet */
+	u32	bogus_every;		/* garble every Nth packet */
+	u32	stall_every;		/* stall every Nth command */
+	u32	serial;
+	u8	nv_mem[GOTEMP_NV_MEM_SIZE];
+};
+
+struct f_gotemp_opts {
+	struct usb_function_instance func_inst;
+	struct mutex lock;		/* protects everything below */
+	int refcnt;			/* functions using these params */
+	struct gotemp_params params;
+};
+
+struct f_gotemp {
+	struct usb_function function;
+	struct usb_ep *in_ep;
+	struct usb_request *reqs[GOTEMP_NR_REQS];
+	struct gotemp_params params;	/* our own copy, nv_mem included */
+
+	/* everything below is touched from interrupt context */
+	spinlock_t lock;
+	struct hrtimer timer;
+	unsigned long free_reqs;	/* bitmap of idle reqs */
+	bool enabled;
+	bool measuring;
+	u64 period_ns;
+	ktime_t start;			/* where the waveform starts */
+	s16 pending[MAX_MEASUREMENTS_IN_PACKET];
+	unsigned int nr_pending;
+	u8 counter;
+	unsigned int packets;
+	unsigned int commands;
+	struct response_packet responses[GOTEMP_NR_RESPONSES];
+	unsigned int resp_head;
+	unsigned int resp_tail;
+	u8 led;
+};
+
+static inline struct f_gotemp *func_to_gotemp(struct usb_function *f)
+{
+	return container_of(f, struct f_gotemp, function);
+}
+
+static struct usb_interface_descriptor gotemp_intf = {
+	.bLength =		USB_DT_INTERFACE_SIZE,
+	.bDescriptorType =	USB_DT_INTERFACE,
+	.bNumEndpoints =	1,
+	.bInterfaceClass =	USB_CLASS_HID,
+	/* .bInterfaceNumber and .iInterface are set at bind time */
+};
+
+static struct usb_endpoint_descriptor fs_in_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+	.bEndpointAddress =	USB_DIR_IN,
+	.bmAttributes =		USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize =	cpu_to_le16(GOTEMP_PACKET_SIZE),
+	.bInterval =		10,
+};
+
+static struct usb_endpoint_descriptor hs_in_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+	.bmAttributes =		USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize =	cpu_to_le16(GOTEMP_PACKET_SIZE),
+	.bInterval =		USB_MS_TO_HS_INTERVAL(8),
+};
+
+static struct usb_descriptor_header *fs_gotemp_descs[] = {
+	(struct usb_descriptor_header *) &gotemp_intf,
+	(struct usb_descriptor_header *) &fs_in_desc,
+	NULL,
+};
+
+static struct usb_descriptor_header *hs_gotemp_descs[] = {
+	(struct usb_descriptor_header *) &gotemp_intf,
+	(struct usb_descriptor_header *) &hs_in_desc,
+	NULL,
+};
+
+static struct usb_string gotemp_string_defs[] = {
+	[0].s = "Go! Temp emulator",
+	{ }
+};
+
+static struct usb_gadget_strings gotemp_string_table = {
+	.language =	0x0409,	/* en-us */
+	.strings =	gotemp_string_defs,
+};
+
+static struct usb_gadget_strings *gotemp_strings[] = {
+	&gotemp_string_table,
+	NULL,
+};
+
+/*
+ * What a fresh probe has in its NV memory: a Go!Temp DDS record with a
+ * linear calibration of A = 0, B = 1 on page 0, the raw reading being
+ * 1/128 degree C per count already.
+ */
+static void gotemp_default_nv_mem(u8 *nv)
+{
+	u8 sum = 0;
+	int i;
+
+	memset(nv, 0, GOTEMP_NV_MEM_SIZE);
+	nv[1] = 60;					/* Go!Temp */
+	memcpy(nv + DDS_LONG_NAME, "Temperature", 11);
+	memcpy(nv + DDS_SHORT_NAME, "Temp", 4);
+	nv[DDS_CAL_EQUATION] = 1;			/* linear */
+	/* A = 0.0f, B = 1.0f, C = 0.0f, little endian */
+	nv[DDS_CAL_PAGES + 6] = 0x80;
+	nv[DDS_CAL_PAGES + 7] = 0x3f;
+	memcpy(nv + DDS_CAL_PAGES + 12, "(C)", 3);
+
+	for (i = 0; i < DDS_CHECKSUM; ++i)
+		sum ^= nv[i];
+	nv[DDS_CHECKSUM] = sum;
+}
+
+/* the temperature the script says it is, in device counts */
+static s16 gotemp_next_sample(struct f_gotemp *gt, ktime_t now)
+{
+	struct gotemp_params *p = &gt->params;
+	s64 mdeg = p->base_mdeg;
+	s64 amp = p->amplitude_mdeg;
+	u32 phase = 0;
+
+	/* without a period every waveform is flat */
+	if (!p->wave_period_ms)
+		goto noise;
+	div_u64_rem(ktime_ms_delta(now, gt->start), p->wave_period_ms, &phase);
+
+	switch (p->waveform) {
+	case WAVE_SINE:
+		mdeg += (amp * fixp_sin32(div_u64((u64)phase * 360,
+						  p->wave_period_ms))) >> 31;
+		break;
+	case WAVE_RAMP:
+		mdeg += div_u64(2 * amp * phase, p->wave_period_ms) - amp;
+		break;
+	case WAVE_SQUARE:
+		mdeg += phase < p->wave_period_ms / 2 ? amp : -amp;
+		break;
+	default:
+		break;
+	}
+
+noise:
+	if (p->noise_mdeg)
+		mdeg += (s64)get_random_u32_below(2 * p->noise_mdeg + 1) -
+			p->noise_mdeg;
+
+	/* 1/128 degree C per count */
+	return clamp_t(s64, div_s64(mdeg * 128, 1000), S16_MIN, S16_MAX);
+}
+
+/*
+ * Fill in a measurement packet with whatever is pending, or drop it on
+ * the floor if a gap is due.  Either way the rolling counter moves on,
+ * just like it does when the real device loses one.
+ *
+ * Called with gt->lock held.
+ */
+static bool gotemp_fill_measurements(struct f_gotemp *gt,
+				     struct measurement_packet *pkt)
+{
+	struct gotemp_params *p = &gt->params;
+	unsigned int i;
+
+	gt->packets++;
+	pkt->rolling_counter = gt->counter++;
+	if (p->gap_every && !(gt->packets % p->gap_every)) {
+		gt->nr_pending = 0;
+		return false;
+	}
+
+	pkt->measurements_in_packet = gt->nr_pending;
+	for (i = 0; i < MAX_MEASUREMENTS_IN_PACKET; ++i)
+		pkt->measurements[i] = i < gt->nr_pending ?
+				       cpu_to_le16(gt->pending[i]) : 0;
+	gt->nr_pending = 0;
+
+	/* a measurement count no device would ever send */
+	if (p->bogus_every && !(gt->packets % p->bogus_every))
+		pkt->measurements_in_packet = 0x3f;
+	return true;
+}
+
+/*
+ * Put out as much as there are idle requests for, responses first.
+ *
+ * Called with gt->lock held.
+ */
+static void gotemp_flush(struct f_gotemp *gt)
+{
+	struct usb_request *req;
+	unsigned int i;
+
+	while (gt->enabled && gt->free_reqs &&
+	       (gt->resp_head != gt->resp_tail || gt->nr_pending)) {
+		i = __ffs(gt->free_reqs);
+		req = gt->reqs[i];
+
+		if (gt->resp_head != gt->resp_tail) {
+			memcpy(req->buf, &gt->responses[gt->resp_tail++ %
+							GOTEMP_NR_RESPONSES],
+			       GOTEMP_PACKET_SIZE);
+		} else if (!gotemp_fill_measurements(gt, req->buf)) {
+			continue;
+		}
+
+		req->length = GOTEMP_PACKET_SIZE;
+		__clear_bit(i, &gt->free_reqs);
+		if (usb_ep_queue(gt->in_ep, req, GFP_ATOMIC)) {
+			__set_bit(i, &gt->free_reqs);
+			break;
+		}
+	}
+}
+
+static void gotemp_in_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct f_gotemp *gt = ep->driver_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gt->lock, flags);
+	__set_bit((unsigned long)req->context, &gt->free_reqs);
+	if (!req->status)
+		gotemp_flush(gt);
+	spin_unlock_irqrestore(&gt->lock, flags);
+}
+
+static enum hrtimer_restart gotemp_timer(struct hrtimer *timer)
+{
+	struct f_gotemp *gt = container_of(timer, struct f_gotemp, timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gt->lock, flags);
+	if (gt->measuring) {
+		/* nobody picked the last ones up, so the device drops them */
+		if (gt->nr_pending == MAX_MEASUREMENTS_IN_PACKET) {
+			gt->counter++;
+			gt->nr_pending = 0;
+		}
+		gt->pending[gt->nr_pending++] =
+			gotemp_next_sample(gt, hrtimer_cb_get_time(timer));
+		gotemp_flush(gt);
+
+		hrtimer_forward_now(timer, ns_to_ktime(gt->period_ns));
+		restart = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&gt->lock, flags);
+
+	return restart;
+}
+
+/* called with gt->lock held */
+static void gotemp_respond(struct f_gotemp *gt, u8 cmd, u8 status,
+			   const u8 *data)
+{
+	struct response_packet *r;
+
+	/* a host that never reads just loses the oldest answers */
+	if (gt->resp_head - gt->resp_tail >= GOTEMP_NR_RESPONSES)
+		gt->resp_tail++;
+
+	r = &gt->responses[gt->resp_head++ % GOTEMP_NR_RESPONSES];
+	r->header = PACKET_TYPE_CMD_RESPONSE;
+	r->cmd = cmd;
+	r->status = status;
+	memcpy(r->data, data, sizeof(r->data));
+	gotemp_flush(gt);
+}
+
+static void gotemp_set_period(struct f_gotemp *gt, u32 ticks)
+{
+	gt->period_ns = max_t(u64, div_u64((u64)ticks * NSEC_PER_SEC,
+					   GOTEMP_TICKS_PER_SEC),
+			      GOTEMP_MIN_PERIOD_US * NSEC_PER_USEC);
+}
+
+static u32 gotemp_get_period(struct f_gotemp *gt)
+{
+	return div_u64(gt->period_ns * GOTEMP_TICKS_PER_SEC, NSEC_PER_SEC);
+}
+
+/* the data stage of a SET_REPORT is in, act on the command */
+static void gotemp_cmd_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct f_gotemp *gt = req->context;
+	struct output_packet *pkt = req->buf;
+	u8 *nv = gt->params.nv_mem;
+	u8 data[5] = { };
+	unsigned long flags;
+	unsigned int addr, len;
+	u8 status = 0;
+
+	if (req->status || req->actual != sizeof(*pkt))
+		return;
+
+	addr = pkt->params[0];
+	spin_lock_irqsave(&gt->lock, flags);
+	switch (pkt->cmd) {
+	case CMD_ID_INIT:
+		gt->measuring = false;
+		gt->nr_pending = 0;
+		gotemp_set_period(gt, div_u64((u64)gt->params.period_us *
+					      GOTEMP_TICKS_PER_SEC,
+					      USEC_PER_SEC));
+		break;
+	case CMD_ID_START_MEASUREMENTS:
+		if (!gt->measuring) {
+			gt->measuring = true;
+			hrtimer_start(&gt->timer, ns_to_ktime(gt->period_ns),
+				      HRTIMER_MODE_REL);
+		}
+		break;
+	case CMD_ID_STOP_MEASUREMENTS:
+		gt->measuring = false;
+		gt->nr_pending = 0;
+		break;
+	case CMD_ID_SET_MEASUREMENT_PERIOD:
+		gotemp_set_period(gt, get_unaligned_le32(pkt->params));
+		break;
+	case CMD_ID_GET_MEASUREMENT_PERIOD:
+		put_unaligned_le32(gotemp_get_period(gt), data);
+		break;
+	case CMD_ID_GET_STATUS:
+		data[0] = gt->measuring;
+		break;
+	case CMD_ID_WRITE_LOCAL_NV_MEM_1BYTE ... CMD_ID_WRITE_LOCAL_NV_MEM_6BYTES:
+		len = pkt->cmd - CMD_ID_WRITE_LOCAL_NV_MEM_1BYTE + 1;
+		if (addr + len > GOTEMP_NV_MEM_SIZE)
+			status = RESPONSE_STATUS_ERROR;
+		else
+			memcpy(nv + addr, pkt->params + 1, len);
+		break;
+	case CMD_ID_READ_LOCAL_NV_MEM:
+		len = pkt->params[1];
+		if (len > sizeof(data) || addr + len > GOTEMP_NV_MEM_SIZE)
+			status = RESPONSE_STATUS_ERROR;
+		else
+			memcpy(data, nv + addr, len);
+		break;
+	case CMD_ID_SET_LED_STATE:
+		gt->led = pkt->params[0];
+		break;
+	case CMD_ID_GET_LED_STATE:
+		data[0] = gt->led;
+		break;
+	case CMD_ID_GET_SERIAL_NUMBER:
+		put_unaligned_le32(gt->params.serial, data);
+		break;
+	default:
+		status = RESPONSE_STATUS_ERROR;
+		break;
+	}
+	gotemp_respond(gt, pkt->cmd, status, data);
+	spin_unlock_irqrestore(&gt->lock, flags);
+}
+
+static int gotemp_setup(struct usb_function *f,
+			const struct usb_ctrlrequest *ctrl)
+{
+	struct f_gotemp *gt = func_to_gotemp(f);
+	struct usb_composite_dev *cdev = f->config->cdev;
+	struct usb_request *req = cdev->req;
+
+	if (ctrl->bRequestType !=
+	    (USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE) ||
+	    ctrl->bRequest != GOTEMP_SET_REPORT ||
+	    le16_to_cpu(ctrl->wLength) != sizeof(struct output_packet))
+		return -EOPNOTSUPP;
+
+	/* a stall is the worst a control transfer can get */
+	if (gt->params.stall_every &&
+	    !(++gt->commands % gt->params.stall_every))
+		return -EOPNOTSUPP;
+
+	req->length = sizeof(struct output_packet);
+	req->zero = 0;
+	req->context = gt;
+	req->complete = gotemp_cmd_complete;
+	return usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+}
+
+static void gotemp_disable(struct usb_function *f)
+{
+	struct f_gotemp *gt = func_to_gotemp(f);
+	unsigned long flags;
+	bool enabled;
+
+	spin_lock_irqsave(&gt->lock, flags);
+	enabled = gt->enabled;
+	gt->enabled = false;
+	gt->measuring = false;
+	spin_unlock_irqrestore(&gt->lock, flags);
+
+	hrtimer_cancel(&gt->timer);
+	/* gives back every queued request */
+	if (enabled)
+		usb_ep_disable(gt->in_ep);
+}
+
+static int gotemp_set_alt(struct usb_function *f, unsigned int intf,
+			  unsigned int alt)
+{
+	struct f_gotemp *gt = func_to_gotemp(f);
+	struct usb_composite_dev *cdev = f->config->cdev;
+	unsigned long flags;
+	int retval;
+
+	if (alt)
+		return -EINVAL;
+
+	gotemp_disable(f);
+
+	retval = config_ep_by_speed(cdev->gadget, f, gt->in_ep);
+	if (retval)
+		return retval;
+	retval = usb_ep_enable(gt->in_ep);
+	if (retval)
+		return retval;
+	gt->in_ep->driver_data = gt;
+
+	spin_lock_irqsave(&gt->lock, flags);
+	gt->enabled = true;
+	gt->free_reqs = BIT(GOTEMP_NR_REQS) - 1;
+	gt->nr_pending = 0;
+	gt->counter = 0;
+	gt->resp_head = gt->resp_tail = 0;
+	gt->start = ktime_get();
+	gotemp_set_period(gt, div_u64((u64)gt->params.period_us *
+				      GOTEMP_TICKS_PER_SEC, USEC_PER_SEC));
+	spin_unlock_irqrestore(&gt->lock, flags);
+	return 0;
+}
+
+static void gotemp_free_reqs(struct f_gotemp *gt)
+{
+	int i;
+
+	for (i = 0; i < GOTEMP_NR_REQS; ++i) {
+		if (!gt->reqs[i])
+			continue;
+		kfree(gt->reqs[i]->buf);
+		usb_ep_free_request(gt->in_ep, gt->reqs[i]);
+		gt->reqs[i] = NULL;
+	}
+}
+
+static int gotemp_bind(struct usb_configuration *c, struct usb_function *f)
+{
+	struct f_gotemp *gt = func_to_gotemp(f);
+	struct usb_composite_dev *cdev = c->cdev;
+	struct usb_string *us;
+	struct usb_request *req;
+	int retval;
+	int i;
+
+	retval = usb_interface_id(c, f);
+	if (retval < 0)
+		return retval;
+	gotemp_intf.bInterfaceNumber = retval;
+
+	us = usb_gstrings_attach(cdev, gotemp_strings,
+				 ARRAY_SIZE(gotemp_string_defs));
+	if (IS_ERR(us))
+		return PTR_ERR(us);
+	gotemp_intf.iInterface = us[0].id;
+
+	gt->in_ep = usb_ep_autoconfig(cdev->gadget, &fs_in_desc);
+	if (!gt->in_ep) {
+		ERROR(cdev, "%s: can't autoconfigure on %s\n",
+		      f->name, cdev->gadget->name);
+		return -ENODEV;
+	}
+	hs_in_desc.bEndpointAddress = fs_in_desc.bEndpointAddress;
+
+	for (i = 0; i < GOTEMP_NR_REQS; ++i) {
+		req = usb_ep_alloc_request(gt->in_ep, GFP_KERNEL);
+		if (!req)
+			goto nomem;
+		gt->reqs[i] = req;
+		req->buf = kmalloc(GOTEMP_PACKET_SIZE, GFP_KERNEL);
+		if (!req->buf)
+			goto nomem;
+		req->complete = gotemp_in_complete;
+		req->context = (void *)(unsigned long)i;
+	}
+
+	retval = usb_assign_descriptors(f, fs_gotemp_descs, hs_gotemp_descs,
+					NULL, NULL);
+	if (retval)
+		goto error;
+
+	DBG(cdev, "%s: IN/%s\n", f->name, gt->in_ep->name);
+	return 0;
+
+nomem:
+	retval = -ENOMEM;
+error:
+	gotemp_free_reqs(gt);
+	return retval;
+}
+
+static void gotemp_unbind(struct usb_configuration *c, struct usb_function *f)
+{
+	gotemp_free_reqs(func_to_gotemp(f));
+	usb_free_all_descriptors(f);
+}
+
+static void gotemp_free_func(struct usb_function *f)
+{
+	struct f_gotemp_opts *opts;
+
+	opts = container_of(f->fi, struct f_gotemp_opts, func_inst);
+	mutex_lock(&opts->lock);
+	opts->refcnt--;
+	mutex_unlock(&opts->lock);
+
+	kfree(func_to_gotemp(f));
+}
+
+static struct usb_function *gotemp_alloc(struct usb_function_instance *fi)
+{
+	struct f_gotemp_opts *opts;
+	struct f_gotemp *gt;
+
+	gt = kzalloc(sizeof(*gt), GFP_KERNEL);
+	if (!gt)
+		return ERR_PTR(-ENOMEM);
+
+	opts = container_of(fi, struct f_gotemp_opts, func_inst);
+	mutex_lock(&opts->lock);
+	opts->refcnt++;
+	gt->params = opts->params;
+	mutex_unlock(&opts->lock);
+
+	spin_lock_init(&gt->lock);
+	hrtimer_setup(&gt->timer, gotemp_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+
+	gt->function.name = "gotemp";
+	gt->function.bind = gotemp_bind;
+	gt->function.unbind = gotemp_unbind;
+	gt->function.set_alt = gotemp_set_alt;
+	gt->function.disable = gotemp_disable;
+	gt->function.setup = gotemp_setup;
+	gt->function.free_func = gotemp_free_func;
+
+	return &gt->function;
+}
+
+static inline struct f_gotemp_opts *to_f_gotemp_opts(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct f_gotemp_opts,
+			    func_inst.group);
+}
+
+static void gotemp_attr_release(struct config_item *item)
+{
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);
+
+	usb_put_function_instance(&opts->func_inst);
+}
+
+static struct configfs_item_operations gotemp_item_ops = {
+	.release =	gotemp_attr_release,
+};
+
+/* the params can only change while no gadget is using them */
+#define F_GOTEMP_OPT(name, type)					\
+static ssize_t f_gotemp_opts_##name##_show(struct config_item *item,	\
+					   char *page)			\
+{									\
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);		\
+	ssize_t result;							\
+									\
+	mutex_lock(&opts->lock);					\
+	result = sprintf(page, "%lld\n", (long long)opts->params.name);	\
+	mutex_unlock(&opts->lock);					\
+									\
+	return result;							\
+}									\
+									\
+static ssize_t f_gotemp_opts_##name##_store(struct config_item *item,	\
+					    const char *page, size_t len) \
+{									\
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);		\
+	type num;							\
+	int retval;							\
+									\
+	retval = kstrto##type(page, 0, &num);				\
+	if (retval)							\
+		return retval;						\
+									\
+	mutex_lock(&opts->lock);					\
+	if (opts->refcnt)						\
+		retval = -EBUSY;					\
+	else								\
+		opts->params.name = num;				\
+	mutex_unlock(&opts->lock);					\
+									\
+	return retval ? retval : len;					\
+}									\
+									\
+CONFIGFS_ATTR(f_gotemp_opts_, name)
+
+F_GOTEMP_OPT(period_us, u32);
+F_GOTEMP_OPT(base_mdeg, s32);
+F_GOTEMP_OPT(amplitude_mdeg, u32);
+F_GOTEMP_OPT(wave_period_ms, u32);
+F_GOTEMP_OPT(noise_mdeg, u32);
+F_GOTEMP_OPT(gap_every, u32);
+F_GOTEMP_OPT(bogus_every, u32);
+F_GOTEMP_OPT(stall_every, u32);
+F_GOTEMP_OPT(serial, u32);
+
+static ssize_t f_gotemp_opts_waveform_show(struct config_item *item,
+					   char *page)
+{
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);
+	ssize_t result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%s\n", waveform_names[opts->params.waveform]);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t f_gotemp_opts_waveform_store(struct config_item *item,
+					    const char *page, size_t len)
+{
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);
+	int wave;
+
+	wave = sysfs_match_string(waveform_names, page);
+	if (wave < 0)
+		return wave;
+
+	mutex_lock(&opts->lock);
+	if (opts->refcnt)
+		wave = -EBUSY;
+	else
+		opts->params.waveform = wave;
+	mutex_unlock(&opts->lock);
+
+	return wave < 0 ? wave : len;
+}
+
+CONFIGFS_ATTR(f_gotemp_opts_, waveform);
+
+static struct configfs_attribute *gotemp_attrs[] = {
+	&f_gotemp_opts_attr_period_us,
+	&f_gotemp_opts_attr_waveform,
+	&f_gotemp_opts_attr_base_mdeg,
+	&f_gotemp_opts_attr_amplitude_mdeg,
+	&f_gotemp_opts_attr_wave_period_ms,
+	&f_gotemp_opts_attr_noise_mdeg,
+	&f_gotemp_opts_attr_gap_every,
+	&f_gotemp_opts_attr_bogus_every,
+	&f_gotemp_opts_attr_stall_every,
+	&f_gotemp_opts_attr_serial,
+	NULL,
+};
+
+/* the whole NV memory image, DDS record and all */
+static ssize_t f_gotemp_opts_nv_mem_read(struct config_item *item,
+					 void *buf, size_t size)
+{
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);
+
+	if (buf) {
+		mutex_lock(&opts->lock);
+		memcpy(buf, opts->params.nv_mem, GOTEMP_NV_MEM_SIZE);
+		mutex_unlock(&opts->lock);
+	}
+	return GOTEMP_NV_MEM_SIZE;
+}
+
+static ssize_t f_gotemp_opts_nv_mem_write(struct config_item *item,
+					  const void *buf, size_t size)
+{
+	struct f_gotemp_opts *opts = to_f_gotemp_opts(item);
+	ssize_t retval = size;
+
+	if (size != GOTEMP_NV_MEM_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&opts->lock);
+	if (opts->refcnt)
+		retval = -EBUSY;
+	else
+		memcpy(opts->params.nv_mem, buf, size);
+	mutex_unlock(&opts->lock);
+
+	return retval;
+}
+
+CONFIGFS_BIN_ATTR(f_gotemp_opts_, nv_mem, NULL, GOTEMP_NV_MEM_SIZE);
+
+static struct configfs_bin_attribute *gotemp_bin_attrs[] = {
+	&f_gotemp_opts_attr_nv_mem,
+	NULL,
+};
+
+static const struct config_item_type gotemp_func_type = {
+	.ct_item_ops =	&gotemp_item_ops,
+	.ct_attrs =	gotemp_attrs,
+	.ct_bin_attrs =	gotemp_bin_attrs,
+	.ct_owner =	THIS_MODULE,
+};
+
+static void gotemp_free_instance(struct usb_function_instance *fi)
+{
+	kfree(container_of(fi, struct f_gotemp_opts, func_inst));
+}
+
+static struct usb_function_instance *gotemp_alloc_inst(void)
+{
+	struct f_gotemp_opts *opts;
+
+	opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+	if (!opts)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&opts->lock);
+	opts->func_inst.free_func_inst = gotemp_free_instance;
+
+	/* half a second, like a freshly plugged in probe */
+	opts->params.period_us = 500000;
+	opts->params.base_mdeg = 22000;
+	opts->params.wave_period_ms = 60000;
+	gotemp_default_nv_mem(opts->params.nv_mem);
+
+	config_group_init_type_name(&opts->func_inst.group, "",
+				    &gotemp_func_type);
+
+	return &opts->func_inst;
+}
+
+DECLARE_USB_FUNCTION_INIT(gotemp, gotemp_alloc_inst, gotemp_alloc);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Emulated Vernier Go!Temp USB function");
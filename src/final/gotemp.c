@@ -13,162 +13,3283 @@
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/hashtable.h>
+#include <linux/xarray.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/seq_file.h>
+#include <linux/poll.h>
+#include <linux/ratelimit.h>
+#include <linux/bitops.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/pm_runtime.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/unaligned.h>
+#include <linux/vmalloc.h>
 #include <linux/usb.h>
+#include <linux/hwmon.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/iio/sysfs.h>
+#include "gotemp.h"
+
+#define CREATE_TRACE_POINTS
+#include "gotemp_trace.h"
 
 
 #define DRIVER_AUTHOR "Greg Kroah-Hartman, greg@kroah.com"
 #define DRIVER_DESC "USB GoTemp driver"
 
-#define VENDOR_ID	0x08f7
-#define PRODUCT_ID	0x0002
+#define VENDOR_ID	0x08f7
+#define PRODUCT_ID	0x0002
+
+/* table of devices that work with this driver */
+static struct usb_device_id id_table[] = {
+	{ USB_DEVICE(VENDOR_ID, PRODUCT_ID) },
+	{ },
+};
+MODULE_DEVICE_TABLE(usb, id_table);
+
+/*
+ * The usb major only has a few minors to go around, so the char devices
+ * get a region of their own, big enough for a lab full of probes.
+ */
+#define GOTEMP_MAX_DEVICES	1024
+
+/* serial numbers are hashed into this many buckets, as a power of two */
+#define GOTEMP_SERIAL_HASH_BITS	8
+
+/* the 40 bit serial number, as it shows up in sysfs and udev */
+#define GOTEMP_SERIAL_FMT	"%010llx"
+
+/* number of samples kept for each device, rounded up to a power of two */
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Number of samples buffered per device");
+
+#define GOTEMP_RING_MIN		16
+#define GOTEMP_RING_MAX		65536
+
+/* the records follow the header, one cacheline in */
+#define GOTEMP_RING_DATA_OFFSET	64
+
+/* interrupt urbs kept queued on the endpoint at all times */
+static unsigned int nr_urbs = 4;
+module_param(nr_urbs, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_urbs, "Number of interrupt urbs in flight per device");
+
+#define GOTEMP_MAX_URBS		16
+
+/* windows the stats attribute covers, in seconds */
+#define GOTEMP_STATS_WINDOWS	4
+static unsigned int stats_windows[GOTEMP_STATS_WINDOWS] = { 10, 60, 900 };
+static int nr_stats_windows = 3;
+module_param_array(stats_windows, uint, &nr_stats_windows, S_IRUGO);
+MODULE_PARM_DESC(stats_windows,
+		 "Lengths in seconds of the windows statistics are kept over");
+
+#define GOTEMP_STATS_MAX_WINDOW		(24 * 60 * 60)
+
+/* devices nobody reads from are stopped and suspended */
+static bool autosuspend = true;
+module_param(autosuspend, bool, S_IRUGO);
+MODULE_PARM_DESC(autosuspend, "Suspend devices that are not being read");
+
+static unsigned int idle_timeout_ms = 2000;
+module_param(idle_timeout_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(idle_timeout_ms,
+		 "How long an unused device keeps measuring before it is suspended");
+
+/*
+ * After CMD_ID_INIT the device can still have old packets queued up on the
+ * interrupt endpoint.  We read and throw them away until the endpoint has
+ * been quiet this long, but give up waiting after the timeout.
+ */
+#define GOTEMP_FLUSH_QUIET	msecs_to_jiffies(100)
+#define GOTEMP_FLUSH_TIMEOUT	msecs_to_jiffies(1000)
+
+/*
+ * A failed interrupt urb is resubmitted after a backoff that doubles
+ * with every retry that fails again, and after this many the device is
+ * reset.  The last backoff is 1.28 seconds, and it takes about two and
+ * a half seconds of errors to get there.
+ */
+#define GOTEMP_RETRY_MIN_MS	10
+#define GOTEMP_RETRIES_BEFORE_RESET	8
+
+/*
+ * The debugfs histograms have a bucket per power of two nanoseconds, the
+ * last one catching everything from about 68 seconds up.
+ */
+#define GOTEMP_HIST_BUCKETS	38
+
+enum gotemp_state {
+	GOTEMP_STATE_INIT,		/* need to send CMD_ID_INIT */
+	GOTEMP_STATE_FLUSHING,		/* draining stale packets */
+	GOTEMP_STATE_RUNNING,		/* measurements are streaming */
+	GOTEMP_STATE_FAILED,
+};
+
+/* measurement period the device starts out with */
+#define GOTEMP_DEFAULT_PERIOD_NS	(500 * NSEC_PER_MSEC)
+
+/* measurement periods the device can do */
+#define GOTEMP_MIN_PERIOD_NS		(10 * NSEC_PER_MSEC)
+#define GOTEMP_MAX_PERIOD_NS		(60 * NSEC_PER_SEC)
+
+/* how long the device gets to answer a command on the interrupt pipe */
+#define GOTEMP_RESPONSE_TIMEOUT		msecs_to_jiffies(1000)
+
+/*
+ * In adaptive mode the period is halved whenever the temperature moves
+ * faster than GOTEMP_ADAPT_FAST_RATE (raw counts per second), and
+ * doubled back up once it has moved slower than GOTEMP_ADAPT_SLOW_RATE
+ * for GOTEMP_ADAPT_STABLE samples in a row.
+ */
+#define GOTEMP_ADAPT_FAST_RATE		32	/* 0.25 degree C/s */
+#define GOTEMP_ADAPT_SLOW_RATE		4	/* 0.03 degree C/s */
+#define GOTEMP_ADAPT_STABLE		16
+
+/*
+ * Sample timestamps follow the earliest the packets could have been
+ * measured, and creep 1/16 of the way towards later arrivals so they
+ * track any drift between the device and host clocks.  If arrivals are
+ * this many periods late the device must have stalled, so start over.
+ */
+#define GOTEMP_TS_CREEP_SHIFT		4
+#define GOTEMP_TS_RESYNC_PERIODS	8
+
+#define CMD_ID_GET_STATUS			0x10
+#define CMD_ID_WRITE_LOCAL_NV_MEM_1BYTE		0x11
+#define CMD_ID_WRITE_LOCAL_NV_MEM_2BYTES	0x12
+#define CMD_ID_WRITE_LOCAL_NV_MEM_3BYTES	0x13
+#define CMD_ID_WRITE_LOCAL_NV_MEM_4BYTES	0x14
+#define CMD_ID_WRITE_LOCAL_NV_MEM_5BYTES	0x15
+#define CMD_ID_WRITE_LOCAL_NV_MEM_6BYTES	0x16
+#define CMD_ID_READ_LOCAL_NV_MEM		0x17
+#define CMD_ID_START_MEASUREMENTS		0x18
+#define CMD_ID_STOP_MEASUREMENTS		0x19
+#define CMD_ID_INIT				0x1A
+#define CMD_ID_SET_MEASUREMENT_PERIOD		0x1B
+#define CMD_ID_GET_MEASUREMENT_PERIOD		0x1C
+#define CMD_ID_SET_LED_STATE			0x1D
+#define CMD_ID_GET_LED_STATE			0x1E
+#define CMD_ID_GET_SERIAL_NUMBER		0x20
+
+struct output_packet {
+	u8	cmd;
+	union {
+		u8	params[7];
+		__le32	period;	/* CMD_ID_SET_MEASUREMENT_PERIOD */
+	} __attribute__ ((packed));
+} __attribute__ ((packed));
+
+struct measurement_packet {
+	u8	measurements_in_packet;
+	u8	rolling_counter;
+	__le16	measurement0;
+	__le16	measurement1;
+	__le16	measurement2;
+} __attribute__ ((packed));
+
+#define MAX_MEASUREMENTS_IN_PACKET	3
+
+/*
+ * Packets on the interrupt pipe are either measurements or the answer to
+ * a command, told apart by the top bits of the first byte.
+ */
+#define PACKET_TYPE_MASK		0xc0
+#define PACKET_TYPE_MEASUREMENT		0x00
+#define PACKET_TYPE_CMD_RESPONSE	0x80
+
+struct response_packet {
+	u8	header;
+	u8	cmd;		/* the command this answers */
+	u8	status;		/* zero if it worked */
+	union {
+		u8	data[5];
+		__le32	period;	/* CMD_ID_GET_MEASUREMENT_PERIOD */
+	} __attribute__ ((packed));
+} __attribute__ ((packed));
+
+/* the measurement period is counted in ticks of 21.333us */
+#define GOTEMP_TICKS_PER_SEC		46875
+
+/* what the probe is specified for, the default hwmon limits */
+#define GOTEMP_RANGE_MIN_MDEG		-20000
+#define GOTEMP_RANGE_MAX_MDEG		110000
+
+/* the sensor's DDS record in NV memory, which has the calibration */
+#define GOTEMP_NV_MEM_SIZE		128
+#define DDS_CAL_EQUATION		58
+#define DDS_HIGHEST_CAL_PAGE		68
+#define DDS_ACTIVE_CAL_PAGE		69
+#define DDS_CAL_PAGES			70
+#define DDS_CAL_PAGE_SIZE		19	/* A, B and C, then units */
+#define DDS_CAL_UNITS			12
+#define DDS_NR_CAL_PAGES		3
+
+#define DDS_EQUATION_LINEAR		1
+#define DDS_EQUATION_QUADRATIC		2
+
+/*
+ * The calibration, as mdeg = (a + b * raw + c * raw^2) >> GOTEMP_CAL_SHIFT
+ * so the sample path gets by with two multiplications.  Each coefficient
+ * is kept below its limit, which keeps the sum from overflowing for any
+ * raw value.
+ */
+struct gotemp_calibration {
+	s64 a;
+	s64 b;
+	s64 c;
+};
+
+#define GOTEMP_CAL_SHIFT		32
+#define GOTEMP_CAL_MAX_A		(1LL << 61)
+#define GOTEMP_CAL_MAX_B		(1LL << 45)
+#define GOTEMP_CAL_MAX_C		(1LL << 30)
+
+/* 1/128 degree C per count, what it is without a calibration */
+static const struct gotemp_calibration gotemp_nominal_cal = {
+	.b = 125LL << 28,			/* 1000 / 128 */
+};
+
+/* an alarm clears this far back inside its limit, unless set otherwise */
+#define GOTEMP_DEFAULT_HYST_MDEG	1000
+
+#define GOTEMP_ALARM_LOW		0x01
+#define GOTEMP_ALARM_HIGH		0x02
+
+/*
+ * Commands go out through a small pool of control urbs, see queue_cmd().
+ * A control transfer gets as long as usb_control_msg() used to give it.
+ */
+#define GOTEMP_CMD_SLOTS		8
+#define GOTEMP_CMD_TIMEOUT		msecs_to_jiffies(10000)
+
+/* queue_cmd() flags */
+#define GOTEMP_CMD_RESPONSE	0x01	/* done once the device answers */
+#define GOTEMP_CMD_MERGE	0x02	/* may replace the same queued command */
+#define GOTEMP_CMD_ATOMIC	0x04	/* don't sleep waiting for a free slot */
+#define GOTEMP_CMD_WAIT		0x08	/* the caller waits for it to finish */
+#define GOTEMP_CMD_KEEP		(GOTEMP_CMD_RESPONSE | GOTEMP_CMD_MERGE)
+
+struct gotemp;
+
+struct gotemp_cmd {
+	struct list_head list;		/* free, queued or done */
+	struct gotemp *gdev;
+	struct urb *urb;
+	struct output_packet *pkt;	/* in gdev->cmd_bufs */
+	unsigned int flags;		/* GOTEMP_CMD_KEEP bits */
+	unsigned int users;		/* the queue, and maybe a waiter */
+	bool urb_done;
+	bool timed_out;
+	bool have_response;
+	int status;
+	unsigned long deadline;
+	u64 sent_ns;			/* 0 until it went on the wire */
+	void (*callback)(struct gotemp_cmd *cmd);
+	struct completion done;
+	struct response_packet response;
+};
+
+/*
+ * Each statistics window is split into GOTEMP_STATS_BUCKETS buckets, so
+ * old samples can age out a bucket at a time without being kept around.
+ * Means are in raw counts scaled up by GOTEMP_STATS_SHIFT bits, and the
+ * sums of squares by twice that, so the integer math keeps fractions.
+ */
+#define GOTEMP_STATS_BUCKETS		8	/* a power of two */
+#define GOTEMP_STATS_SHIFT		8
+
+struct gotemp_moments {
+	u32 n;
+	s16 min;
+	s16 max;
+	s64 mean;			/* scaled */
+	u64 m2;				/* sum of squared deviations, scaled */
+};
+
+struct gotemp_window {
+	u64 window_ns;
+	u64 bucket_ns;
+	u64 cur_id;			/* bucket of the newest sample */
+	struct gotemp_moments buckets[GOTEMP_STATS_BUCKETS];
+	struct gotemp_moments older;	/* all but the newest bucket */
+	s64 ewma;			/* scaled, time constant window_ns */
+	u64 ewma_ts;
+	bool have_ewma;
+};
+
+/*
+ * The newest sample, as everything outside the sample path sees it.  It
+ * is published under a seqcount, so readers always get one whole sample
+ * without taking gdev->lock or ever holding up read_int_callback.
+ */
+struct gotemp_reading {
+	u64 timestamp_ns;		/* 0 until the first sample */
+	u32 sequence;
+	s16 raw;
+	u8 rolling_counter;
+	int mdeg;
+};
+
+/*
+ * Counters for debugfs.  Every cpu gets its own copy, so counting costs
+ * the sample path a few unlocked adds to memory nobody else writes, and
+ * only reading them out adds up all the copies.
+ */
+struct gotemp_hist {
+	u64 count;
+	u64 sum_ns;
+	u64 buckets[GOTEMP_HIST_BUCKETS];	/* by fls64() of the time */
+};
+
+/* the urb errors that get a counter of their own, the rest are "other" */
+static const int gotemp_urb_errnos[] = {
+	EPIPE, EPROTO, EILSEQ, ETIME, EOVERFLOW, ECOMM, ENOSR, EREMOTEIO,
+	EINVAL, ENOMEM, EXDEV, EHOSTUNREACH,
+};
+
+struct gotemp_debug_stats {
+	u64 completions;		/* interrupt urbs, good or not */
+	u64 bytes;
+	u64 errors[ARRAY_SIZE(gotemp_urb_errnos) + 1];
+	u64 resubmit_failures;
+	u64 resets;
+	u64 gaps;			/* jumps in the rolling counter */
+	u64 lost_packets;		/* how many packets they skipped */
+	u64 cmds;
+	u64 cmd_errors;
+	u64 cmd_timeouts;
+	struct gotemp_hist interval;	/* between measurement packets */
+	struct gotemp_hist cmd_latency;	/* command submitted to done */
+};
+
+static void hist_add(struct gotemp_hist __percpu *hist, u64 ns)
+{
+	this_cpu_inc(hist->count);
+	this_cpu_add(hist->sum_ns, ns);
+	this_cpu_inc(hist->buckets[min(fls64(ns), GOTEMP_HIST_BUCKETS - 1)]);
+}
+
+/* how many samples read() copies out per trip through the lock */
+#define GOTEMP_READ_BATCH	16
+
+struct gotemp {
+	struct usb_device *udev;
+	struct usb_interface *interface;
+	struct list_head list;		/* on gotemp_list */
+	struct kref kref;
+
+	/* the char device, and its entry in gotemp_serials */
+	u32 minor;
+	struct device *chrdev;		/* NULL once disconnected */
+	struct dentry *debugfs_dir;
+	struct gotemp_debug_stats __percpu *dstats;
+	struct hlist_node serial_node;
+	u64 serial;
+	bool have_serial;
+	__u8 int_in_endpointAddr;
+	struct usb_anchor int_in_anchor;
+	unsigned int nr_urbs;
+	struct urb *int_in_urbs[GOTEMP_MAX_URBS];
+
+	/* error recovery, see urb_error() */
+	struct delayed_work retry_work;
+	unsigned long parked_urbs;	/* waiting for retry_work */
+	unsigned int retries;		/* rounds that failed in a row */
+	bool urbs_stopped;		/* on purpose, don't retry */
+	bool clear_halt;
+	bool reset_queued;
+	struct ratelimit_state err_ratelimit;
+
+	/* one coherent buffer, carved up between the interrupt urbs */
+	unsigned char *int_in_buffers;
+	dma_addr_t int_in_dma;
+	size_t int_in_size;		/* bytes per urb */
+
+	/* device bring up, see init_work_handler() */
+	struct delayed_work init_work;
+	enum gotemp_state state;
+	unsigned long flush_deadline;
+	unsigned int flushed;
+	bool bringup_pm;		/* holding a pm reference for it */
+
+	/*
+	 * samples, written by the interrupt urb and drained by read() or
+	 * straight out of an mmap() of ring_hdr.  Everything the completion
+	 * handler touches starts here, on a cacheline of its own.
+	 */
+	spinlock_t lock ____cacheline_aligned_in_smp;
+	struct gotemp_ring_header *ring_hdr;
+	struct gotemp_sample *ring;
+	u32 ring_size;
+	u32 head;			/* sequence of the next sample */
+	seqcount_spinlock_t reading_seq;
+	struct gotemp_reading reading;	/* see get_reading() */
+	wait_queue_head_t read_wait;
+
+	/* industrial I/O device, also fed from the sample path */
+	struct iio_dev *indio_dev;
+
+	/* hwmon history and limits, also protected by lock */
+	s16 highest;
+	s16 lowest;
+	bool have_history;
+	int min_mdeg;
+	int max_mdeg;
+	int min_hyst_mdeg;
+	int max_hyst_mdeg;
+	u8 alarms;			/* GOTEMP_ALARM_* */
+	u8 alarms_reported;		/* what alarm_work last told about */
+	struct work_struct alarm_work;
+	struct device *hwmon_dev;
+
+	/* windowed statistics, also protected by lock */
+	struct gotemp_window windows[GOTEMP_STATS_WINDOWS];
+	unsigned int nr_windows;
+
+	/* packet accounting, also protected by lock */
+	u64 packets;
+	u64 lost_packets;
+	u64 last_arrival;
+	u8 last_counter;
+	bool have_counter;
+
+	/* timestamp reconstruction, also protected by lock */
+	u64 period_ns;			/* device measurement period */
+	u64 ts_anchor;			/* time of the last sample we decoded */
+	u64 last_ts;			/* timestamp of the newest sample */
+	unsigned int last_count;	/* measurements in the last packet */
+	bool ts_synced;
+
+	/* adaptive sampling, also protected by lock */
+	bool adaptive;
+	u64 base_period_ns;		/* slowest period, set by the user */
+	u64 adaptive_min_ns;		/* fastest period adaptive mode uses */
+	s16 adapt_last_raw;
+	bool adapt_primed;
+	unsigned int adapt_stable;
+	bool period_change_pending;
+
+	/* calibration from the device, also protected by lock */
+	struct gotemp_calibration cal;
+	u8 cal_equation;		/* 0 until we have the device's */
+	bool cal_read;			/* don't read it again */
+
+	/* the command queue, everything below is protected by cmd_lock */
+	spinlock_t cmd_lock;
+	struct list_head cmd_free;
+	struct list_head cmd_queue;
+	struct gotemp_cmd *cmd_active;	/* the one on the wire */
+	bool cmd_dead;			/* disconnected, refuse new ones */
+	wait_queue_head_t cmd_slot_wait;
+	struct delayed_work cmd_timeout_work;
+	struct usb_anchor cmd_anchor;
+	struct gotemp_cmd cmds[GOTEMP_CMD_SLOTS];
+
+	/* the command packets, from coherent memory like the urb buffers */
+	struct output_packet *cmd_bufs;
+	dma_addr_t cmd_dma;
+
+	/* serializes autopm calls against disconnect */
+	struct mutex pm_mutex;
+	bool disconnected;
+
+	/* keeps nv_mem reads and writes from interleaving */
+	struct mutex nv_mutex;
+
+	/*
+	 * every command urb shares this setup packet.  It gets DMA mapped,
+	 * so it sits on cachelines of its own at the end of the structure.
+	 */
+	struct usb_ctrlrequest cmd_setup __aligned(ARCH_DMA_MINALIGN);
+};
+
+/* every open file keeps its own position in the ring */
+struct gotemp_reader {
+	struct gotemp *gdev;
+	struct mutex mutex;		/* serializes read() on this file */
+	u32 pos;			/* sequence of the next sample to read */
+};
+
+/* every attached device, for the driver wide snapshot */
+static LIST_HEAD(gotemp_list);
+static DEFINE_MUTEX(gotemp_list_lock);
+
+/* and by serial number, also protected by gotemp_list_lock */
+static DEFINE_HASHTABLE(gotemp_serials, GOTEMP_SERIAL_HASH_BITS);
+
+/* the char devices, minor to struct gotemp */
+static DEFINE_XARRAY_ALLOC(gotemp_minors);
+static dev_t gotemp_devt;
+static struct cdev gotemp_cdev;
+
+/* every device gets a directory of counters in here */
+static struct dentry *gotemp_debugfs_root;
+
+
+static void gotemp_delete(struct kref *kref)
+{
+	struct gotemp *gdev = container_of(kref, struct gotemp, kref);
+	int i;
+
+	/* hwmon outlives disconnect, and a limit written since queues this */
+	cancel_work_sync(&gdev->alarm_work);
+
+	for (i = 0; i < gdev->nr_urbs; ++i)
+		usb_free_urb(gdev->int_in_urbs[i]);
+	if (gdev->int_in_buffers)
+		usb_free_coherent(gdev->udev,
+				  gdev->nr_urbs * gdev->int_in_size,
+				  gdev->int_in_buffers, gdev->int_in_dma);
+	for (i = 0; i < GOTEMP_CMD_SLOTS; ++i)
+		usb_free_urb(gdev->cmds[i].urb);
+	if (gdev->cmd_bufs)
+		usb_free_coherent(gdev->udev,
+				  GOTEMP_CMD_SLOTS * sizeof(*gdev->cmd_bufs),
+				  gdev->cmd_bufs, gdev->cmd_dma);
+	vfree(gdev->ring_hdr);
+	free_percpu(gdev->dstats);
+	usb_put_dev(gdev->udev);
+	kfree(gdev);
+}
+
+static void cmd_put(struct gotemp *gdev, struct gotemp_cmd *c)
+{
+	unsigned long flags;
+	bool freed;
+
+	spin_lock_irqsave(&gdev->cmd_lock, flags);
+	freed = !--c->users;
+	if (freed)
+		list_add(&c->list, &gdev->cmd_free);
+	spin_unlock_irqrestore(&gdev->cmd_lock, flags);
+
+	if (freed)
+		wake_up(&gdev->cmd_slot_wait);
+}
+
+/*
+ * Take a command off the wire and put it on the done list, which the
+ * caller runs through with cmd_complete() once cmd_lock is dropped, so
+ * callbacks are free to take gdev->lock or queue more commands.
+ *
+ * Called with gdev->cmd_lock held.
+ */
+static void cmd_finish(struct gotemp *gdev, struct gotemp_cmd *c, int status,
+		       struct list_head *done)
+{
+	c->status = status;
+	if (gdev->cmd_active == c)
+		gdev->cmd_active = NULL;
+
+	this_cpu_inc(gdev->dstats->cmds);
+	if (status == -ETIMEDOUT)
+		this_cpu_inc(gdev->dstats->cmd_timeouts);
+	else if (status)
+		this_cpu_inc(gdev->dstats->cmd_errors);
+	else if (c->sent_ns)
+		hist_add(&gdev->dstats->cmd_latency,
+			 ktime_get_ns() - c->sent_ns);
+
+	list_add_tail(&c->list, done);
+}
+
+static void cmd_complete(struct gotemp *gdev, struct list_head *done)
+{
+	struct gotemp_cmd *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, done, list) {
+		list_del_init(&c->list);
+		trace_gotemp_cmd(&gdev->interface->dev, c->pkt->cmd, c->status);
+		if (c->callback)
+			c->callback(c);
+		complete_all(&c->done);
+		cmd_put(gdev, c);
+	}
+}
+
+/*
+ * Put the next queued command on the wire, if nothing else is on it.
+ * Only one is ever outstanding, because the answers on the interrupt
+ * pipe only say which command they belong to, not which instance.
+ *
+ * Called with gdev->cmd_lock held, from any context.
+ */
+static void cmd_kick(struct gotemp *gdev, struct list_head *done)
+{
+	struct gotemp_cmd *c;
+	int retval;
+
+	while (!gdev->cmd_active && !gdev->cmd_dead &&
+	       !list_empty(&gdev->cmd_queue)) {
+		c = list_first_entry(&gdev->cmd_queue, struct gotemp_cmd, list);
+		list_del_init(&c->list);
+		gdev->cmd_active = c;
+
+		usb_anchor_urb(c->urb, &gdev->cmd_anchor);
+		retval = usb_submit_urb(c->urb, GFP_ATOMIC);
+		if (retval) {
+			usb_unanchor_urb(c->urb);
+			c->urb_done = true;
+			cmd_finish(gdev, c, retval, done);
+			continue;
+		}
+		c->sent_ns = ktime_get_ns();
+		c->deadline = jiffies + GOTEMP_CMD_TIMEOUT;
+		mod_delayed_work(system_wq, &gdev->cmd_timeout_work,
+				 GOTEMP_CMD_TIMEOUT);
+	}
+}
+
+/* done when the device took it, or once it answers if we want that */
+static void cmd_urb_callback(struct urb *urb)
+{
+	struct gotemp_cmd *c = urb->context;
+	struct gotemp *gdev = c->gdev;
+	int status = urb->status;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	if (!status && urb->actual_length != sizeof(*c->pkt))
+		status = -EIO;
+
+	spin_lock_irqsave(&gdev->cmd_lock, flags);
+	c->urb_done = true;
+	if (c->timed_out) {
+		cmd_finish(gdev, c, -ETIMEDOUT, &done);
+	} else if (status) {
+		cmd_finish(gdev, c, gdev->cmd_dead ? -ENODEV : status, &done);
+	} else if (!(c->flags & GOTEMP_CMD_RESPONSE)) {
+		cmd_finish(gdev, c, 0, &done);
+	} else if (c->have_response) {
+		cmd_finish(gdev, c, c->response.status ? -EIO : 0, &done);
+	} else {
+		/* now the clock runs on the answer */
+		c->deadline = jiffies + GOTEMP_RESPONSE_TIMEOUT;
+		mod_delayed_work(system_wq, &gdev->cmd_timeout_work,
+				 GOTEMP_RESPONSE_TIMEOUT);
+	}
+	cmd_kick(gdev, &done);
+	spin_unlock_irqrestore(&gdev->cmd_lock, flags);
+
+	cmd_complete(gdev, &done);
+}
+
+/* called from read_int_callback for every command response packet */
+static void handle_response(struct gotemp *gdev, unsigned char *data,
+			    int length)
+{
+	struct response_packet *response = (struct response_packet *)data;
+	struct gotemp_cmd *c;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	if (length < sizeof(*response))
+		return;
+
+	spin_lock_irqsave(&gdev->cmd_lock, flags);
+	c = gdev->cmd_active;
+	/* the answer can beat the control urb's own completion */
+	if (c && (c->flags & GOTEMP_CMD_RESPONSE) && !c->have_response &&
+	    response->cmd == c->pkt->cmd) {
+		c->response = *response;
+		c->have_response = true;
+		if (c->urb_done) {
+			cmd_finish(gdev, c, response->status ? -EIO : 0, &done);
+			cmd_kick(gdev, &done);
+		}
+	}
+	spin_unlock_irqrestore(&gdev->cmd_lock, flags);
+
+	cmd_complete(gdev, &done);
+}
+
+/* fail the command on the wire if it has been there too long */
+static void cmd_timeout_handler(struct work_struct *work)
+{
+	struct gotemp *gdev = container_of(to_delayed_work(work),
+					   struct gotemp, cmd_timeout_work);
+	struct gotemp_cmd *c, *stuck = NULL;
+	LIST_HEAD(done);
+
+	spin_lock_irq(&gdev->cmd_lock);
+	c = gdev->cmd_active;
+	if (c && !c->timed_out) {
+		if (time_before(jiffies, c->deadline)) {
+			mod_delayed_work(system_wq, &gdev->cmd_timeout_work,
+					 c->deadline - jiffies);
+		} else if (c->urb_done) {
+			cmd_finish(gdev, c, -ETIMEDOUT, &done);
+			cmd_kick(gdev, &done);
+		} else {
+			/* the reference keeps the urb from being reused */
+			c->timed_out = true;
+			c->users++;
+			stuck = c;
+		}
+	}
+	spin_unlock_irq(&gdev->cmd_lock);
+
+	cmd_complete(gdev, &done);
+
+	if (stuck) {
+		usb_kill_urb(stuck->urb);
+		cmd_put(gdev, stuck);
+	}
+}
+
+/*
+ * Queue a command for the device.  Commands go out one at a time in the
+ * order they were queued, from the completion of the one before, so no
+ * caller ever waits on the wire unless it wants to.  Once the command is
+ * done, callback is run in atomic context and anyone waiting on it is
+ * woken up.
+ *
+ * With GOTEMP_CMD_MERGE, a queued command with the same id that has not
+ * gone out yet just gets the new parameters, so a burst of updates only
+ * sends the last one.  That returns the merged command.
+ *
+ * With GOTEMP_CMD_WAIT the caller holds a reference to the command and
+ * has to give it back with cmd_put(), otherwise the pointer returned is
+ * only good for IS_ERR().
+ */
+static struct gotemp_cmd *queue_cmd(struct gotemp *gdev, u8 cmd,
+				    const void *params, size_t len,
+				    unsigned int flags,
+				    void (*callback)(struct gotemp_cmd *cmd))
+{
+	struct gotemp_cmd *c;
+	unsigned long irqflags;
+	LIST_HEAD(done);
+
+	if (len > sizeof(c->pkt->params))
+		return ERR_PTR(-EINVAL);
+
+	spin_lock_irqsave(&gdev->cmd_lock, irqflags);
+	for (;;) {
+		if (gdev->cmd_dead) {
+			c = ERR_PTR(-ENODEV);
+			goto exit;
+		}
+
+		if (flags & GOTEMP_CMD_MERGE) {
+			list_for_each_entry_reverse(c, &gdev->cmd_queue, list) {
+				if (c->pkt->cmd == cmd &&
+				    c->flags == (flags & GOTEMP_CMD_KEEP) &&
+				    c->callback == callback) {
+					memset(c->pkt->params, 0,
+					       sizeof(c->pkt->params));
+					if (len)
+						memcpy(c->pkt->params, params,
+						       len);
+					goto queued;
+				}
+			}
+		}
+
+		if (!list_empty(&gdev->cmd_free))
+			break;
+		if (flags & GOTEMP_CMD_ATOMIC) {
+			c = ERR_PTR(-EBUSY);
+			goto exit;
+		}
+
+		spin_unlock_irqrestore(&gdev->cmd_lock, irqflags);
+		if (wait_event_killable(gdev->cmd_slot_wait,
+					!list_empty(&gdev->cmd_free) ||
+					READ_ONCE(gdev->cmd_dead)))
+			return ERR_PTR(-EINTR);
+		spin_lock_irqsave(&gdev->cmd_lock, irqflags);
+	}
+
+	c = list_first_entry(&gdev->cmd_free, struct gotemp_cmd, list);
+	list_del(&c->list);
+	c->flags = flags & GOTEMP_CMD_KEEP;
+	c->users = 1;
+	c->urb_done = false;
+	c->timed_out = false;
+	c->have_response = false;
+	c->status = 0;
+	c->sent_ns = 0;
+	c->callback = callback;
+	reinit_completion(&c->done);
+	memset(c->pkt, 0, sizeof(*c->pkt));
+	c->pkt->cmd = cmd;
+	if (len)
+		memcpy(c->pkt->params, params, len);
+	list_add_tail(&c->list, &gdev->cmd_queue);
+
+queued:
+	if (flags & GOTEMP_CMD_WAIT)
+		c->users++;
+	cmd_kick(gdev, &done);
+exit:
+	spin_unlock_irqrestore(&gdev->cmd_lock, irqflags);
+
+	cmd_complete(gdev, &done);
+	return c;
+}
+
+static int send_cmd_async(struct gotemp *gdev, u8 cmd, const void *params,
+			  size_t len, unsigned int flags,
+			  void (*callback)(struct gotemp_cmd *cmd))
+{
+	return PTR_ERR_OR_ZERO(queue_cmd(gdev, cmd, params, len, flags,
+					 callback));
+}
+
+static int send_cmd_wait(struct gotemp *gdev, u8 cmd, const void *params,
+			 size_t len, unsigned int flags,
+			 struct response_packet *response)
+{
+	struct gotemp_cmd *c;
+	int retval;
+
+	c = queue_cmd(gdev, cmd, params, len, flags | GOTEMP_CMD_WAIT, NULL);
+	if (IS_ERR(c))
+		return PTR_ERR(c);
+
+	/* cmd_timeout_handler() makes sure this ends */
+	wait_for_completion(&c->done);
+	retval = c->status;
+	if (response)
+		*response = c->response;
+	cmd_put(gdev, c);
+	return retval;
+}
+
+static int send_cmd(struct gotemp *gdev, u8 cmd, const void *params,
+		    size_t len)
+{
+	return send_cmd_wait(gdev, cmd, params, len, 0, NULL);
+}
+
+/*
+ * Send a command and wait for the device to answer it on the interrupt
+ * pipe, so the interrupt urbs have to be running.
+ */
+static int send_cmd_response(struct gotemp *gdev, u8 cmd, const void *params,
+			     size_t len, struct response_packet *response)
+{
+	return send_cmd_wait(gdev, cmd, params, len, GOTEMP_CMD_RESPONSE,
+			     response);
+}
+
+/*
+ * Fail everything queued with -ENODEV and refuse anything new, for
+ * disconnect.  Anyone waiting on a command gets woken up.
+ */
+static void cmd_cancel_all(struct gotemp *gdev)
+{
+	struct gotemp_cmd *c, *tmp;
+	LIST_HEAD(done);
+
+	spin_lock_irq(&gdev->cmd_lock);
+	gdev->cmd_dead = true;
+	list_for_each_entry_safe(c, tmp, &gdev->cmd_queue, list) {
+		list_del(&c->list);
+		cmd_finish(gdev, c, -ENODEV, &done);
+	}
+	spin_unlock_irq(&gdev->cmd_lock);
+	cmd_complete(gdev, &done);
+	wake_up_all(&gdev->cmd_slot_wait);
+
+	/* the one on the wire fails from its own completion */
+	usb_kill_anchored_urbs(&gdev->cmd_anchor);
+	cancel_delayed_work_sync(&gdev->cmd_timeout_work);
+
+	/* unless it was only waiting for an answer, which won't come now */
+	spin_lock_irq(&gdev->cmd_lock);
+	c = gdev->cmd_active;
+	if (c)
+		cmd_finish(gdev, c, -ENODEV, &done);
+	spin_unlock_irq(&gdev->cmd_lock);
+	cmd_complete(gdev, &done);
+}
+
+static u64 ticks_to_ns(u32 ticks)
+{
+	return div_u64((u64)ticks * NSEC_PER_SEC, GOTEMP_TICKS_PER_SEC);
+}
+
+static u32 ns_to_ticks(u64 ns)
+{
+	return div_u64(ns * GOTEMP_TICKS_PER_SEC, NSEC_PER_SEC);
+}
+
+/* the old timestamps don't say anything about the new period */
+static void update_period(struct gotemp *gdev, u64 period_ns)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->lock, flags);
+	gdev->period_ns = period_ns;
+	gdev->ts_synced = false;
+	gdev->adapt_primed = false;
+	gdev->adapt_stable = 0;
+	spin_unlock_irqrestore(&gdev->lock, flags);
+}
+
+static int get_period(struct gotemp *gdev)
+{
+	struct response_packet response;
+	u64 period_ns;
+	int retval;
+
+	retval = send_cmd_response(gdev, CMD_ID_GET_MEASUREMENT_PERIOD,
+				   NULL, 0, &response);
+	if (retval)
+		return retval;
+
+	/* the sample path divides by it, so keep the one we have instead */
+	period_ns = ticks_to_ns(le32_to_cpu(response.period));
+	if (period_ns < GOTEMP_MIN_PERIOD_NS ||
+	    period_ns > GOTEMP_MAX_PERIOD_NS)
+		return -EPROTO;
+
+	update_period(gdev, period_ns);
+	return 0;
+}
+
+/* runs once the device took the new period, or failed to */
+static void period_callback(struct gotemp_cmd *c)
+{
+	struct gotemp *gdev = c->gdev;
+	unsigned long flags;
+
+	if (!c->status)
+		update_period(gdev, ticks_to_ns(le32_to_cpu(c->pkt->period)));
+	else if (c->status != -ENODEV)
+		dev_warn(&gdev->udev->dev,
+			 "Error %d changing the measurement period\n",
+			 c->status);
+
+	spin_lock_irqsave(&gdev->lock, flags);
+	gdev->period_change_pending = false;
+	spin_unlock_irqrestore(&gdev->lock, flags);
+}
+
+/*
+ * Queue a new measurement period, replacing one that has not gone out
+ * yet.  The device counts whole ticks, and that is what gets sent, so
+ * once it has taken the command we know the period it runs at.
+ *
+ * Must not be called with gdev->lock held.
+ */
+static int set_period(struct gotemp *gdev, u64 period_ns, unsigned int flags)
+{
+	__le32 ticks = cpu_to_le32(ns_to_ticks(period_ns));
+
+	return send_cmd_async(gdev, CMD_ID_SET_MEASUREMENT_PERIOD,
+			      &ticks, sizeof(ticks), GOTEMP_CMD_MERGE | flags,
+			      period_callback);
+}
+
+/*
+ * Speed sampling up while the temperature is moving, and back down once
+ * it settles.  Called with gdev->lock held for the last measurement of
+ * every packet, along with how many measurements were taken since the
+ * last one it saw, counting those in lost packets.  Returns the period
+ * to switch to, or 0 to stay put.  The caller queues that with
+ * set_period() once the lock is dropped.
+ */
+static u64 adapt_period(struct gotemp *gdev, s16 raw, unsigned int samples)
+{
+	u64 rate, target;
+
+	if (!gdev->adapt_primed) {
+		gdev->adapt_primed = true;
+		gdev->adapt_last_raw = raw;
+		return 0;
+	}
+
+	rate = div64_u64((u64)abs(raw - gdev->adapt_last_raw) * NSEC_PER_SEC,
+			 gdev->period_ns * samples);
+	gdev->adapt_last_raw = raw;
+
+	if (!gdev->adaptive || gdev->period_change_pending)
+		return 0;
+
+	target = gdev->period_ns;
+	if (rate >= GOTEMP_ADAPT_FAST_RATE) {
+		gdev->adapt_stable = 0;
+		target = max(gdev->period_ns / 2, gdev->adaptive_min_ns);
+	} else if (rate <= GOTEMP_ADAPT_SLOW_RATE) {
+		gdev->adapt_stable += samples;
+		if (gdev->adapt_stable >= GOTEMP_ADAPT_STABLE) {
+			gdev->adapt_stable = 0;
+			target = min(gdev->period_ns * 2, gdev->base_period_ns);
+		}
+	} else {
+		gdev->adapt_stable = 0;
+	}
+
+	if (target == gdev->period_ns)
+		return 0;
+
+	gdev->period_change_pending = true;
+	return target;
+}
+
+/*
+ * Queue up every interrupt urb on the endpoint.  The host controller
+ * completes them in the order they were submitted, and each one goes
+ * back to the end of the queue from its completion handler, so packets
+ * are still handed to read_int_callback in the order the device sent
+ * them, but there is never a moment with nothing queued.
+ */
+static int start_urbs(struct gotemp *gdev, gfp_t mem_flags)
+{
+	struct urb *urb;
+	int retval;
+	int i;
+
+	spin_lock_irq(&gdev->lock);
+	gdev->parked_urbs = 0;
+	spin_unlock_irq(&gdev->lock);
+	WRITE_ONCE(gdev->urbs_stopped, false);
+
+	for (i = 0; i < gdev->nr_urbs; ++i) {
+		urb = gdev->int_in_urbs[i];
+		usb_anchor_urb(urb, &gdev->int_in_anchor);
+		retval = usb_submit_urb(urb, mem_flags);
+		if (retval) {
+			usb_unanchor_urb(urb);
+			usb_kill_anchored_urbs(&gdev->int_in_anchor);
+			return retval;
+		}
+	}
+	return 0;
+}
+
+/* stop them again, including any waiting out a backoff */
+static void stop_urbs(struct gotemp *gdev)
+{
+	WRITE_ONCE(gdev->urbs_stopped, true);
+	cancel_delayed_work_sync(&gdev->retry_work);
+	usb_kill_anchored_urbs(&gdev->int_in_anchor);
+	/* a completion that was already in urb_error() may have queued it */
+	cancel_delayed_work_sync(&gdev->retry_work);
+}
+
+/*
+ * An interrupt urb failed.  Resubmitting it straight away would, on a
+ * flaky cable or hub, just fail again as fast as the host controller
+ * can go, so it is parked instead and retry_work resubmits it after a
+ * backoff.  If the retries keep failing the device gets reset, which
+ * runs the bring up again from gotemp_post_reset().
+ *
+ * Called from the completion handler.
+ */
+static void urb_error(struct gotemp *gdev, struct urb *urb, int status)
+{
+	unsigned int retries = READ_ONCE(gdev->retries);
+	unsigned long flags;
+	bool reset = false;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gotemp_urb_errnos); ++i)
+		if (status == -gotemp_urb_errnos[i])
+			break;
+	this_cpu_inc(gdev->dstats->errors[i]);
+
+	trace_gotemp_error(&gdev->interface->dev, "urb status", status);
+	if (__ratelimit(&gdev->err_ratelimit))
+		dev_err(&gdev->interface->dev,
+			"interrupt urb failed with status %d\n", status);
+
+	spin_lock_irqsave(&gdev->lock, flags);
+	for (i = 0; i < gdev->nr_urbs; ++i)
+		if (gdev->int_in_urbs[i] == urb)
+			__set_bit(i, &gdev->parked_urbs);
+	if (status == -EPIPE)
+		gdev->clear_halt = true;
+	if (retries >= GOTEMP_RETRIES_BEFORE_RESET && !gdev->reset_queued)
+		reset = gdev->reset_queued = true;
+	spin_unlock_irqrestore(&gdev->lock, flags);
+
+	if (READ_ONCE(gdev->urbs_stopped) || READ_ONCE(gdev->disconnected))
+		return;
+
+	if (reset) {
+		this_cpu_inc(gdev->dstats->resets);
+		dev_err(&gdev->interface->dev,
+			"%u retries failed, resetting the device\n", retries);
+		usb_queue_reset_device(gdev->interface);
+	} else if (!gdev->reset_queued) {
+		schedule_delayed_work(&gdev->retry_work,
+			msecs_to_jiffies(GOTEMP_RETRY_MIN_MS << retries));
+	}
+}
+
+static void retry_work_handler(struct work_struct *work)
+{
+	struct gotemp *gdev = container_of(to_delayed_work(work),
+					   struct gotemp, retry_work);
+	unsigned long parked;
+	struct urb *urb;
+	bool clear_halt;
+	int retval;
+	int i;
+
+	spin_lock_irq(&gdev->lock);
+	parked = gdev->parked_urbs;
+	gdev->parked_urbs = 0;
+	clear_halt = gdev->clear_halt;
+	gdev->clear_halt = false;
+	spin_unlock_irq(&gdev->lock);
+
+	/* a success in between sets this back to zero */
+	WRITE_ONCE(gdev->retries, gdev->retries + 1);
+
+	/* a stall only goes away once it is cleared */
+	if (clear_halt) {
+		retval = usb_clear_halt(gdev->udev,
+					usb_rcvintpipe(gdev->udev,
+						       gdev->int_in_endpointAddr));
+		if (retval)
+			dev_dbg(&gdev->interface->dev,
+				"Error %d clearing the halt\n", retval);
+	}
+
+	for_each_set_bit(i, &parked, gdev->nr_urbs) {
+		if (READ_ONCE(gdev->urbs_stopped))
+			break;
+		urb = gdev->int_in_urbs[i];
+		usb_anchor_urb(urb, &gdev->int_in_anchor);
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+		if (retval) {
+			usb_unanchor_urb(urb);
+			this_cpu_inc(gdev->dstats->resubmit_failures);
+			urb_error(gdev, urb, retval);
+		}
+	}
+}
+
+/* keep the device awake until init_work_handler() is done with it */
+static void start_bringup(struct gotemp *gdev)
+{
+	if (!gdev->bringup_pm) {
+		usb_autopm_get_interface_no_resume(gdev->interface);
+		gdev->bringup_pm = true;
+	}
+	WRITE_ONCE(gdev->state, GOTEMP_STATE_INIT);
+	schedule_delayed_work(&gdev->init_work, 0);
+}
+
+static void end_bringup(struct gotemp *gdev)
+{
+	/* async, a suspend right now would wait for us */
+	if (gdev->bringup_pm) {
+		gdev->bringup_pm = false;
+		usb_autopm_put_interface_async(gdev->interface);
+	}
+}
+
+/* call with gotemp_list_lock held */
+static struct gotemp *gotemp_find_serial(u64 serial)
+{
+	struct gotemp *gdev;
+
+	hash_for_each_possible(gotemp_serials, gdev, serial_node, serial)
+		if (gdev->serial == serial)
+			return gdev;
+	return NULL;
+}
+
+/*
+ * The serial number tells probes apart wherever they are plugged in.  It
+ * is read once, on the first bring up, hashed so GOTEMP_IOC_FIND_SERIAL
+ * finds it right away however many devices there are, and announced to
+ * udev for the /dev/gotemp/by-serial/ links.
+ */
+static void read_serial(struct gotemp *gdev)
+{
+	struct response_packet response;
+	u64 serial = 0;
+	int retval;
+	int i;
+
+	retval = send_cmd_response(gdev, CMD_ID_GET_SERIAL_NUMBER, NULL, 0,
+				   &response);
+	if (!retval && response.status)
+		retval = -EIO;
+	if (retval) {
+		dev_warn(&gdev->interface->dev,
+			 "Error %d reading the serial number\n", retval);
+		return;
+	}
+
+	for (i = sizeof(response.data) - 1; i >= 0; --i)
+		serial = serial << 8 | response.data[i];
+
+	mutex_lock(&gotemp_list_lock);
+	/* too late, disconnect already took the char device away */
+	if (gdev->chrdev) {
+		if (gotemp_find_serial(serial))
+			dev_warn(&gdev->interface->dev,
+				 "serial number " GOTEMP_SERIAL_FMT
+				 " is used twice\n", serial);
+		gdev->serial = serial;
+		hash_add(gotemp_serials, &gdev->serial_node, serial);
+		smp_store_release(&gdev->have_serial, true);
+		kobject_uevent(&gdev->chrdev->kobj, KOBJ_CHANGE);
+	}
+	mutex_unlock(&gotemp_list_lock);
+}
+
+/* read NV memory, as much at a time as fits in a response */
+static int nv_read(struct gotemp *gdev, unsigned int addr, u8 *buf,
+		   size_t len)
+{
+	struct response_packet response;
+	u8 params[2];
+	size_t chunk;
+	int retval;
+
+	while (len) {
+		chunk = min(len, sizeof(response.data));
+		params[0] = addr;
+		params[1] = chunk;
+		retval = send_cmd_response(gdev, CMD_ID_READ_LOCAL_NV_MEM,
+					   params, sizeof(params), &response);
+		if (!retval && response.status)
+			retval = -EIO;
+		if (retval)
+			return retval;
+
+		memcpy(buf, response.data, chunk);
+		addr += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * And write it, in as few commands as possible: every WRITE_LOCAL_NV_MEM
+ * command takes an address and up to six bytes.
+ */
+static int nv_write(struct gotemp *gdev, unsigned int addr, const u8 *buf,
+		    size_t len)
+{
+	u8 params[7];
+	size_t chunk;
+	int retval;
+
+	while (len) {
+		chunk = min(len, sizeof(params) - 1);
+		params[0] = addr;
+		memcpy(params + 1, buf, chunk);
+		retval = send_cmd(gdev, CMD_ID_WRITE_LOCAL_NV_MEM_1BYTE +
+					chunk - 1, params, chunk + 1);
+		if (retval)
+			return retval;
+
+		addr += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * An IEEE 754 single in fixed point with GOTEMP_CAL_SHIFT fraction bits,
+ * times 1000 / 128^power, with nothing but shifts.  NaNs, infinities and
+ * anything that doesn't fit in 62 bits are refused.
+ */
+static bool float_to_fixed(u32 f, int power, s64 *out)
+{
+	int exp = (f >> 23) & 0xff;
+	u64 mant = f & 0x7fffff;
+	int shift;
+
+	if (exp == 0xff)
+		return false;
+	if (exp)
+		mant |= 0x800000;
+	else
+		exp = 1;		/* denormal */
+
+	/* f = mant * 2^(exp - 150) */
+	mant *= 1000;
+	shift = exp - 150 + GOTEMP_CAL_SHIFT - 7 * power;
+	if (shift > 0) {
+		if (shift >= 62 || mant >> (62 - shift))
+			return false;
+		mant <<= shift;
+	} else if (shift < 0) {
+		mant = -shift >= 64 ? 0 :
+		       (mant + (1ULL << (-shift - 1))) >> -shift;
+	}
+
+	*out = f & 0x80000000 ? -(s64)mant : (s64)mant;
+	return true;
+}
+
+/* "(C)" and the like, but not "(F)" or "(K)" */
+static bool cal_page_is_celsius(const u8 *page)
+{
+	return memchr(page + DDS_CAL_UNITS, 'C',
+		      DDS_CAL_PAGE_SIZE - DDS_CAL_UNITS);
+}
+
+static bool cal_from_page(const u8 *page, u8 equation,
+			  struct gotemp_calibration *cal)
+{
+	if (!float_to_fixed(get_unaligned_le32(page), 0, &cal->a) ||
+	    !float_to_fixed(get_unaligned_le32(page + 4), 1, &cal->b) ||
+	    !float_to_fixed(get_unaligned_le32(page + 8), 2, &cal->c))
+		return false;
+	if (equation == DDS_EQUATION_LINEAR)
+		cal->c = 0;
+
+	return abs(cal->a) < GOTEMP_CAL_MAX_A &&
+	       abs(cal->b) < GOTEMP_CAL_MAX_B &&
+	       abs(cal->c) < GOTEMP_CAL_MAX_C;
+}
+
+/*
+ * Use the calibration the probe carries in its DDS record instead of the
+ * nominal 1/128 degree per count, if it has a sane one for degrees C.
+ * Its coefficients are floats for t = raw / 128, so they get turned into
+ * fixed point here, once.  Reading the whole record takes a few dozen
+ * commands, so it only happens on the first bring up.
+ */
+static void read_calibration(struct gotemp *gdev)
+{
+	struct gotemp_calibration cal;
+	const u8 *page = NULL;
+	unsigned int nr_pages;
+	u8 equation;
+	u8 sum = 0;
+	u8 *nv;
+	int retval;
+	int i;
+
+	nv = kmalloc(GOTEMP_NV_MEM_SIZE, GFP_KERNEL);
+	if (!nv)
+		return;
+
+	retval = nv_read(gdev, 0, nv, GOTEMP_NV_MEM_SIZE);
+	if (retval) {
+		dev_warn(&gdev->interface->dev,
+			 "Error %d reading the calibration\n", retval);
+		goto exit;
+	}
+	gdev->cal_read = true;
+
+	/* the last byte makes the whole record XOR to zero */
+	for (i = 0; i < GOTEMP_NV_MEM_SIZE; ++i)
+		sum ^= nv[i];
+	equation = nv[DDS_CAL_EQUATION];
+	if (sum || (equation != DDS_EQUATION_LINEAR &&
+		    equation != DDS_EQUATION_QUADRATIC))
+		goto nominal;
+
+	/* the active page if it is in degrees C, else the first that is */
+	nr_pages = min(nv[DDS_HIGHEST_CAL_PAGE] + 1, DDS_NR_CAL_PAGES);
+	i = nv[DDS_ACTIVE_CAL_PAGE];
+	if (i < nr_pages &&
+	    cal_page_is_celsius(nv + DDS_CAL_PAGES + i * DDS_CAL_PAGE_SIZE))
+		page = nv + DDS_CAL_PAGES + i * DDS_CAL_PAGE_SIZE;
+	for (i = 0; !page && i < nr_pages; ++i)
+		if (cal_page_is_celsius(nv + DDS_CAL_PAGES +
+					i * DDS_CAL_PAGE_SIZE))
+			page = nv + DDS_CAL_PAGES + i * DDS_CAL_PAGE_SIZE;
+	if (!page || !cal_from_page(page, equation, &cal))
+		goto nominal;
+
+	spin_lock_irq(&gdev->lock);
+	gdev->cal = cal;
+	gdev->cal_equation = equation;
+	spin_unlock_irq(&gdev->lock);
+	goto exit;
+
+nominal:
+	dev_info(&gdev->interface->dev,
+		 "no usable calibration, using 1/128 degree per count\n");
+	spin_lock_irq(&gdev->lock);
+	gdev->cal = gotemp_nominal_cal;
+	gdev->cal_equation = 0;
+	spin_unlock_irq(&gdev->lock);
+exit:
+	kfree(nv);
+}
+
+/*
+ * Bring the device up without ever sleeping in probe: send CMD_ID_INIT,
+ * start the interrupt urbs and let read_int_callback throw away whatever
+ * stale packets come in.  Every one of them pushes this work out by
+ * GOTEMP_FLUSH_QUIET, so once it finally runs again the endpoint is
+ * flushed and we can start the measurements.
+ */
+static void init_work_handler(struct work_struct *work)
+{
+	struct gotemp *gdev = container_of(to_delayed_work(work),
+					   struct gotemp, init_work);
+	int retval;
+
+	if (READ_ONCE(gdev->disconnected))
+		return;
+
+	switch (gdev->state) {
+	case GOTEMP_STATE_INIT:
+		retval = send_cmd(gdev, CMD_ID_INIT, NULL, 0);
+		if (retval)
+			goto error;
+
+		gdev->flushed = 0;
+		gdev->flush_deadline = jiffies + GOTEMP_FLUSH_TIMEOUT;
+		WRITE_ONCE(gdev->state, GOTEMP_STATE_FLUSHING);
+
+		retval = start_urbs(gdev, GFP_KERNEL);
+		if (retval) {
+			dev_err(&gdev->udev->dev,
+				"%s - Error %d submitting interrupt urbs\n",
+				__func__, retval);
+			goto error;
+		}
+		schedule_delayed_work(&gdev->init_work, GOTEMP_FLUSH_QUIET);
+		break;
+
+	case GOTEMP_STATE_FLUSHING:
+		dev_dbg(&gdev->udev->dev, "flushed %u stale packets\n",
+			gdev->flushed);
+
+		if (!gdev->have_serial)
+			read_serial(gdev);
+		if (!gdev->cal_read)
+			read_calibration(gdev);
+
+		/* use the period the user asked for, or find out the default */
+		if (gdev->base_period_ns)
+			retval = set_period(gdev, gdev->base_period_ns, 0);
+		else
+			retval = get_period(gdev);
+		if (retval)
+			dev_warn(&gdev->udev->dev,
+				 "Error %d setting up the measurement period\n",
+				 retval);
+		spin_lock_irq(&gdev->lock);
+		if (!gdev->base_period_ns)
+			gdev->base_period_ns = gdev->period_ns;
+		spin_unlock_irq(&gdev->lock);
+
+		/* anything that shows up from now on is a real measurement */
+		WRITE_ONCE(gdev->state, GOTEMP_STATE_RUNNING);
+		retval = send_cmd(gdev, CMD_ID_START_MEASUREMENTS, NULL, 0);
+		if (retval)
+			goto error;
+		end_bringup(gdev);
+		break;
+
+	default:
+		break;
+	}
+	return;
+
+error:
+	dev_err(&gdev->udev->dev, "device initialization failed: %d\n",
+		retval);
+	WRITE_ONCE(gdev->state, GOTEMP_STATE_FAILED);
+	stop_urbs(gdev);
+	end_bringup(gdev);
+}
+
+/* a consumer showed up, wake the device and keep it measuring */
+static int gotemp_pm_get(struct gotemp *gdev)
+{
+	int retval = -ENODEV;
+
+	mutex_lock(&gdev->pm_mutex);
+	if (!gdev->disconnected)
+		retval = usb_autopm_get_interface(gdev->interface);
+	mutex_unlock(&gdev->pm_mutex);
+	return retval;
+}
+
+/* and it is gone again, suspend after idle_timeout_ms */
+static void gotemp_pm_put(struct gotemp *gdev)
+{
+	mutex_lock(&gdev->pm_mutex);
+	if (!gdev->disconnected) {
+		usb_mark_last_busy(gdev->udev);
+		usb_autopm_put_interface(gdev->interface);
+	}
+	mutex_unlock(&gdev->pm_mutex);
+}
+
+/*
+ * Someone looked at the cached values without opening the device.  They
+ * are served right away, but the device gets woken up if needed and
+ * kept measuring for another idle_timeout_ms, so a poller that comes
+ * back regularly sees fresh ones.
+ */
+static void gotemp_touch(struct gotemp *gdev)
+{
+	mutex_lock(&gdev->pm_mutex);
+	if (!gdev->disconnected) {
+		usb_mark_last_busy(gdev->udev);
+		if (!usb_autopm_get_interface_async(gdev->interface))
+			usb_autopm_put_interface_async(gdev->interface);
+	}
+	mutex_unlock(&gdev->pm_mutex);
+}
+
+/* Welford's update of the running mean and sum of squares */
+static void moments_add(struct gotemp_moments *m, s16 raw)
+{
+	s64 x = (s64)raw << GOTEMP_STATS_SHIFT;
+	s64 delta = x - m->mean;
+
+	if (!m->n || raw < m->min)
+		m->min = raw;
+	if (!m->n || raw > m->max)
+		m->max = raw;
+	m->n++;
+	m->mean += div_s64(delta, m->n);
+	m->m2 += delta * (x - m->mean);
+}
+
+/* and Chan's for combining two of them */
+static void moments_merge(struct gotemp_moments *a,
+			  const struct gotemp_moments *b)
+{
+	s64 delta = b->mean - a->mean;
+	u32 n = a->n + b->n;
+
+	if (!b->n)
+		return;
+	if (!a->n) {
+		*a = *b;
+		return;
+	}
+
+	a->m2 += b->m2 + mul_u64_u64_div_u64(delta * delta,
+					     (u64)a->n * b->n, n);
+	a->mean += div_s64(delta * b->n, n);
+	a->min = min(a->min, b->min);
+	a->max = max(a->max, b->max);
+	a->n = n;
+}
+
+/*
+ * Account a sample to a window.  The buckets the clock moved past since
+ * the last sample start over, and the older ones are merged once here
+ * rather than on every read.
+ *
+ * Called with gdev->lock held.
+ */
+static void window_add(struct gotemp_window *w, u64 timestamp, s16 raw)
+{
+	s64 x = (s64)raw << GOTEMP_STATS_SHIFT;
+	u64 id = div64_u64(timestamp, w->bucket_ns);
+	u64 dt;
+	int i;
+
+	if (id > w->cur_id || !w->have_ewma) {
+		if (id - w->cur_id >= GOTEMP_STATS_BUCKETS || !w->have_ewma)
+			memset(w->buckets, 0, sizeof(w->buckets));
+		else
+			while (w->cur_id < id)
+				memset(&w->buckets[++w->cur_id &
+						   (GOTEMP_STATS_BUCKETS - 1)],
+				       0, sizeof(w->buckets[0]));
+		w->cur_id = id;
+
+		memset(&w->older, 0, sizeof(w->older));
+		for (i = 1; i < GOTEMP_STATS_BUCKETS; i++)
+			moments_merge(&w->older,
+				      &w->buckets[(id - i) &
+						  (GOTEMP_STATS_BUCKETS - 1)]);
+	}
+	moments_add(&w->buckets[w->cur_id & (GOTEMP_STATS_BUCKETS - 1)], raw);
+
+	/* weigh the sample by how long it stood for */
+	if (w->have_ewma) {
+		dt = min(timestamp - w->ewma_ts, w->window_ns);
+		w->ewma += div_s64((x - w->ewma) *
+				   (s64)div_u64(dt, NSEC_PER_USEC),
+				   div_u64(w->window_ns, NSEC_PER_USEC));
+	} else {
+		w->ewma = x;
+		w->have_ewma = true;
+	}
+	w->ewma_ts = timestamp;
+}
+
+static void init_windows(struct gotemp *gdev)
+{
+	struct gotemp_window *w;
+	int i;
+
+	for (i = 0; i < nr_stats_windows; ++i) {
+		if (!stats_windows[i])
+			continue;
+		w = &gdev->windows[gdev->nr_windows++];
+		w->window_ns = (u64)min_t(unsigned int, stats_windows[i],
+					  GOTEMP_STATS_MAX_WINDOW) *
+			       NSEC_PER_SEC;
+		w->bucket_ns = div_u64(w->window_ns, GOTEMP_STATS_BUCKETS);
+	}
+}
+
+/* raw is an s16, or one past it */
+static int raw_to_mdeg(const struct gotemp_calibration *cal, int raw)
+{
+	s64 x = cal->a + cal->b * raw + cal->c * raw * raw;
+
+	return (x + (1LL << (GOTEMP_CAL_SHIFT - 1))) >> GOTEMP_CAL_SHIFT;
+}
+
+/* a scaled mean, in between the two counts around it */
+static s64 stats_to_mdeg(const struct gotemp_calibration *cal, s64 value)
+{
+	int raw = value >> GOTEMP_STATS_SHIFT;
+	s64 frac = value & ((1 << GOTEMP_STATS_SHIFT) - 1);
+	int mdeg = raw_to_mdeg(cal, raw);
+
+	return mdeg + (((raw_to_mdeg(cal, raw + 1) - mdeg) * frac) >>
+		       GOTEMP_STATS_SHIFT);
+}
+
+/*
+ * The variance around a scaled mean in millidegrees squared, from m2
+ * scaled by 2^16.  The calibration's slope at the mean is taken with 8
+ * fraction bits, 2000 for the nominal 1000 / 128, so slope^2 has 16.
+ */
+static u64 stats_variance(const struct gotemp_calibration *cal,
+			  const struct gotemp_moments *m)
+{
+	s64 slope = (cal->b + 2 * cal->c * (m->mean >> GOTEMP_STATS_SHIFT)) >>
+		    (GOTEMP_CAL_SHIFT - 8);
+
+	return mul_u64_u64_div_u64(m->m2, slope * slope, (u64)m->n << 32);
+}
+
+/* an untorn copy of the newest sample, without taking gdev->lock */
+static void get_reading(struct gotemp *gdev, struct gotemp_reading *reading)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&gdev->reading_seq);
+		*reading = gdev->reading;
+	} while (read_seqcount_retry(&gdev->reading_seq, seq));
+}
+
+static ssize_t show_temp(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	struct gotemp_reading reading;
+
+	gotemp_touch(gdev);
+	get_reading(gdev, &reading);
+	return sprintf(buf, "%d\n", (u16)reading.raw);
+}
+
+static DEVICE_ATTR(temperature, S_IRUGO, show_temp, NULL);
+
+/* the same, calibrated, in millidegrees C */
+static ssize_t show_temp_mdeg(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	struct gotemp_reading reading;
+
+	gotemp_touch(gdev);
+	get_reading(gdev, &reading);
+	if (!reading.timestamp_ns)
+		return -ENODATA;
+	return sprintf(buf, "%d\n", reading.mdeg);
+}
+
+static DEVICE_ATTR(temperature_mdeg, S_IRUGO, show_temp_mdeg, NULL);
+
+static const char * const cal_names[] = {
+	[0] =				"nominal",
+	[DDS_EQUATION_LINEAR] =		"linear",
+	[DDS_EQUATION_QUADRATIC] =	"quadratic",
+};
+
+/* which calibration the millidegrees come from */
+static ssize_t show_calibration(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%s\n", cal_names[READ_ONCE(gdev->cal_equation)]);
+}
+
+static DEVICE_ATTR(calibration, S_IRUGO, show_calibration, NULL);
+
+/* wake the device and have it to ourselves for a few commands */
+static int nv_begin(struct gotemp *gdev)
+{
+	int retval;
+
+	retval = gotemp_pm_get(gdev);
+	if (retval)
+		return retval;
+
+	if (mutex_lock_interruptible(&gdev->nv_mutex)) {
+		gotemp_pm_put(gdev);
+		return -ERESTARTSYS;
+	}
+
+	/* reads need the interrupt urbs, so the bring up has to be done */
+	if (READ_ONCE(gdev->state) != GOTEMP_STATE_RUNNING) {
+		mutex_unlock(&gdev->nv_mutex);
+		gotemp_pm_put(gdev);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+static void nv_end(struct gotemp *gdev)
+{
+	mutex_unlock(&gdev->nv_mutex);
+	gotemp_pm_put(gdev);
+}
+
+/*
+ * The probe's NV memory as a flat file, DDS record and all.  sysfs keeps
+ * accesses inside GOTEMP_NV_MEM_SIZE bytes, and writing a whole image
+ * takes 22 commands.
+ */
+static ssize_t nv_mem_read(struct file *filp, struct kobject *kobj,
+			   const struct bin_attribute *attr, char *buf,
+			   loff_t off, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(kobj_to_dev(kobj));
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	int retval;
+
+	retval = nv_begin(gdev);
+	if (retval)
+		return retval;
+	retval = nv_read(gdev, off, buf, count);
+	nv_end(gdev);
+
+	return retval ? retval : count;
+}
+
+static ssize_t nv_mem_write(struct file *filp, struct kobject *kobj,
+			    const struct bin_attribute *attr, char *buf,
+			    loff_t off, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(kobj_to_dev(kobj));
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	int retval;
+
+	retval = nv_begin(gdev);
+	if (retval)
+		return retval;
+	retval = nv_write(gdev, off, buf, count);
+	/* a new calibration goes into effect right away */
+	if (!retval)
+		read_calibration(gdev);
+	nv_end(gdev);
+
+	return retval ? retval : count;
+}
+
+static const BIN_ATTR_RW(nv_mem, GOTEMP_NV_MEM_SIZE);
+
+/* how long ago the newest sample was measured, to spot stale devices */
+static ssize_t show_sample_age(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	struct gotemp_reading reading;
+	u64 now = ktime_get_boottime_ns();
+
+	gotemp_touch(gdev);
+	get_reading(gdev, &reading);
+	if (!reading.timestamp_ns)
+		return -ENODATA;
+
+	return sprintf(buf, "%llu\n",
+		       div_u64(now - min(now, reading.timestamp_ns),
+			       NSEC_PER_MSEC));
+}
+
+static DEVICE_ATTR(sample_age_ms, S_IRUGO, show_sample_age, NULL);
+
+static ssize_t show_samples(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%u\n", READ_ONCE(gdev->head));
+}
+
+static DEVICE_ATTR(samples, S_IRUGO, show_samples, NULL);
+
+static ssize_t show_packets(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 packets;
+
+	spin_lock_irq(&gdev->lock);
+	packets = gdev->packets;
+	spin_unlock_irq(&gdev->lock);
+
+	return sprintf(buf, "%llu\n", packets);
+}
+
+static DEVICE_ATTR(packets, S_IRUGO, show_packets, NULL);
+
+static ssize_t show_lost_packets(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 lost;
+
+	spin_lock_irq(&gdev->lock);
+	lost = gdev->lost_packets;
+	spin_unlock_irq(&gdev->lock);
+
+	return sprintf(buf, "%llu\n", lost);
+}
+
+static DEVICE_ATTR(lost_packets, S_IRUGO, show_lost_packets, NULL);
+
+/* periods are read and written in microseconds */
+static ssize_t show_sampling_period(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 period_ns;
+
+	spin_lock_irq(&gdev->lock);
+	period_ns = gdev->period_ns;
+	spin_unlock_irq(&gdev->lock);
+
+	return sprintf(buf, "%llu\n", div_u64(period_ns, NSEC_PER_USEC));
+}
+
+static ssize_t parse_period(const char *buf, u64 *period_ns)
+{
+	unsigned int period_us;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &period_us);
+	if (retval)
+		return retval;
+
+	*period_ns = (u64)period_us * NSEC_PER_USEC;
+	if (*period_ns < GOTEMP_MIN_PERIOD_NS ||
+	    *period_ns > GOTEMP_MAX_PERIOD_NS)
+		return -EINVAL;
+	return 0;
+}
+
+static ssize_t set_sampling_period(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 period_ns;
+	int retval;
+
+	retval = parse_period(buf, &period_ns);
+	if (retval)
+		return retval;
+
+	spin_lock_irq(&gdev->lock);
+	gdev->base_period_ns = period_ns;
+	gdev->adaptive_min_ns = min(gdev->adaptive_min_ns, period_ns);
+	spin_unlock_irq(&gdev->lock);
+
+	/*
+	 * before the device is running, init_work_handler() picks it up.
+	 * This only queues the command, so writes to many devices go out
+	 * in parallel.
+	 */
+	if (READ_ONCE(gdev->state) == GOTEMP_STATE_RUNNING) {
+		retval = gotemp_pm_get(gdev);
+		if (retval)
+			return retval;
+		retval = set_period(gdev, period_ns, 0);
+		gotemp_pm_put(gdev);
+	}
+
+	return retval ? retval : count;
+}
+
+static DEVICE_ATTR(sampling_period, S_IRUGO | S_IWUSR,
+		   show_sampling_period, set_sampling_period);
+
+static ssize_t show_adaptive(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%d\n", READ_ONCE(gdev->adaptive));
+}
+
+static ssize_t set_adaptive(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 period_ns = 0;
+	bool adaptive;
+	int retval;
+
+	retval = kstrtobool(buf, &adaptive);
+	if (retval)
+		return retval;
+
+	spin_lock_irq(&gdev->lock);
+	gdev->adaptive = adaptive;
+	gdev->adapt_stable = 0;
+	/* going back to fixed sampling, so return to the user's period */
+	if (!adaptive && gdev->base_period_ns &&
+	    gdev->period_ns != gdev->base_period_ns) {
+		period_ns = gdev->base_period_ns;
+		gdev->period_change_pending = true;
+	}
+	spin_unlock_irq(&gdev->lock);
+
+	if (period_ns) {
+		retval = gotemp_pm_get(gdev);
+		if (!retval) {
+			retval = set_period(gdev, period_ns, 0);
+			gotemp_pm_put(gdev);
+		}
+		if (retval) {
+			spin_lock_irq(&gdev->lock);
+			gdev->period_change_pending = false;
+			spin_unlock_irq(&gdev->lock);
+			return retval;
+		}
+	}
+
+	return count;
+}
+
+static DEVICE_ATTR(adaptive, S_IRUGO | S_IWUSR, show_adaptive, set_adaptive);
+
+static ssize_t show_adaptive_min_period(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 period_ns;
+
+	spin_lock_irq(&gdev->lock);
+	period_ns = gdev->adaptive_min_ns;
+	spin_unlock_irq(&gdev->lock);
+
+	return sprintf(buf, "%llu\n", div_u64(period_ns, NSEC_PER_USEC));
+}
+
+static ssize_t set_adaptive_min_period(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	u64 period_ns;
+	int retval;
+
+	retval = parse_period(buf, &period_ns);
+	if (retval)
+		return retval;
+
+	spin_lock_irq(&gdev->lock);
+	if (gdev->base_period_ns && period_ns > gdev->base_period_ns)
+		retval = -EINVAL;
+	else
+		gdev->adaptive_min_ns = period_ns;
+	spin_unlock_irq(&gdev->lock);
+
+	return retval ? retval : count;
+}
+
+static DEVICE_ATTR(adaptive_min_period, S_IRUGO | S_IWUSR,
+		   show_adaptive_min_period, set_adaptive_min_period);
+
+/*
+ * Buckets only age out as samples come in, so once they stop the window
+ * has to be lined up with the current time here, leaving out whatever
+ * is older than the window by now.
+ *
+ * Called with gdev->lock held.
+ */
+static void window_moments(struct gotemp_window *w, u64 now,
+			   struct gotemp_moments *m)
+{
+	u64 now_id = div64_u64(now, w->bucket_ns);
+	u64 id;
+
+	if (now_id <= w->cur_id) {
+		*m = w->older;
+		moments_merge(m, &w->buckets[w->cur_id &
+					     (GOTEMP_STATS_BUCKETS - 1)]);
+		return;
+	}
+
+	memset(m, 0, sizeof(*m));
+	if (now_id - w->cur_id >= GOTEMP_STATS_BUCKETS)
+		return;
+	/* the newest buckets, as many as are still inside the window */
+	for (id = w->cur_id + GOTEMP_STATS_BUCKETS - now_id; id > 0; --id)
+		moments_merge(m, &w->buckets[(w->cur_id - id + 1) &
+					     (GOTEMP_STATS_BUCKETS - 1)]);
+}
+
+/*
+ * One line per window, everything in millidegrees C, the variance in
+ * millidegrees squared.  All of it is kept up to date as the samples
+ * come in, so reading it merges at most a window's worth of buckets.
+ */
+static ssize_t show_stats(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+	struct gotemp_moments m[GOTEMP_STATS_WINDOWS];
+	s64 ewma[GOTEMP_STATS_WINDOWS];
+	struct gotemp_calibration cal;
+	struct gotemp_window *w;
+	ssize_t len;
+	u64 now;
+	int i;
+
+	gotemp_touch(gdev);
+
+	spin_lock_irq(&gdev->lock);
+	now = ktime_get_boottime_ns();
+	cal = gdev->cal;
+	for (i = 0; i < gdev->nr_windows; ++i) {
+		w = &gdev->windows[i];
+		window_moments(w, now, &m[i]);
+		ewma[i] = w->ewma;
+	}
+	spin_unlock_irq(&gdev->lock);
+
+	len = sprintf(buf, "# window_s samples min max mean variance ewma\n");
+	for (i = 0; i < gdev->nr_windows; ++i) {
+		len += sprintf(buf + len, "%llu %u",
+			       div_u64(gdev->windows[i].window_ns,
+				       NSEC_PER_SEC), m[i].n);
+		if (!m[i].n) {
+			len += sprintf(buf + len, " - - - - -\n");
+			continue;
+		}
+		len += sprintf(buf + len, " %d %d %lld %llu %lld\n",
+			       raw_to_mdeg(&cal, m[i].min),
+			       raw_to_mdeg(&cal, m[i].max),
+			       stats_to_mdeg(&cal, m[i].mean),
+			       stats_variance(&cal, &m[i]),
+			       stats_to_mdeg(&cal, ewma[i]));
+	}
+	return len;
+}
+
+static DEVICE_ATTR(stats, S_IRUGO, show_stats, NULL);
+
+static const char * const alarm_names[] = {
+	[0] =					"none",
+	[GOTEMP_ALARM_LOW] =			"low",
+	[GOTEMP_ALARM_HIGH] =			"high",
+	[GOTEMP_ALARM_LOW | GOTEMP_ALARM_HIGH] =	"low high",
+};
+
+/*
+ * Which alarms are on.  The limits are the hwmon temp1_min and temp1_max,
+ * and poll() on this file wakes up whenever it changes.
+ */
+static ssize_t show_alarm(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct gotemp *gdev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%s\n", alarm_names[READ_ONCE(gdev->alarms)]);
+}
+
+static DEVICE_ATTR(alarm, S_IRUGO, show_alarm, NULL);
+
+static struct attribute *gotemp_attrs[] = {
+	&dev_attr_temperature.attr,
+	&dev_attr_temperature_mdeg.attr,
+	&dev_attr_calibration.attr,
+	&dev_attr_sample_age_ms.attr,
+	&dev_attr_samples.attr,
+	&dev_attr_packets.attr,
+	&dev_attr_lost_packets.attr,
+	&dev_attr_sampling_period.attr,
+	&dev_attr_adaptive.attr,
+	&dev_attr_adaptive_min_period.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_alarm.attr,
+	NULL,
+};
+
+static const struct bin_attribute *const gotemp_bin_attrs[] = {
+	&bin_attr_nv_mem,
+	NULL,
+};
+
+static const struct attribute_group gotemp_attr_group = {
+	.attrs = gotemp_attrs,
+	.bin_attrs = gotemp_bin_attrs,
+};
+
+/*
+ * IIO stamps samples with its own clock, which userspace can pick, so
+ * shift our CLOCK_BOOTTIME timestamp over to it.
+ */
+static void iio_push_sample(struct gotemp *gdev, s16 raw, u64 timestamp)
+{
+	struct iio_dev *indio_dev = gdev->indio_dev;
+	struct {
+		s16 temp;
+		s64 timestamp __aligned(8);
+	} scan;
+
+	/* the padding goes out to userspace too */
+	memset(&scan, 0, sizeof(scan));
+	scan.temp = raw;
+	timestamp += iio_get_time_ns(indio_dev) - ktime_get_boottime_ns();
+	iio_push_to_buffers_with_timestamp(indio_dev, &scan, timestamp);
+}
+
+/*
+ * Alarms go on once the temperature is past a limit, and only off again
+ * once it is back past the hysteresis, so a temperature sitting right at
+ * a limit doesn't make them flap.  Telling anybody about it sleeps, so
+ * that is left to alarm_work.
+ *
+ * Called with gdev->lock held.
+ */
+static void check_alarms(struct gotemp *gdev, int mdeg)
+{
+	u8 alarms = gdev->alarms;
+
+	if (mdeg < gdev->min_mdeg)
+		alarms |= GOTEMP_ALARM_LOW;
+	else if (mdeg >= gdev->min_hyst_mdeg)
+		alarms &= ~GOTEMP_ALARM_LOW;
+
+	if (mdeg > gdev->max_mdeg)
+		alarms |= GOTEMP_ALARM_HIGH;
+	else if (mdeg <= gdev->max_hyst_mdeg)
+		alarms &= ~GOTEMP_ALARM_HIGH;
+
+	if (alarms != gdev->alarms) {
+		gdev->alarms = alarms;
+		schedule_work(&gdev->alarm_work);
+	}
+}
+
+static void push_sample(struct gotemp *gdev, u64 timestamp, u64 arrival,
+			s16 raw, u8 rolling_counter, u8 flags)
+{
+	struct gotemp_sample *sample;
+	int mdeg = raw_to_mdeg(&gdev->cal, raw);
+	int i;
+
+	check_alarms(gdev, mdeg);
+
+	/*
+	 * this overwrites the oldest record, so mmap() readers have to be
+	 * able to see the head that says so before any of the new stores
+	 */
+	smp_wmb();
+	sample = &gdev->ring[gdev->head & (gdev->ring_size - 1)];
+	sample->timestamp_ns = timestamp;
+	sample->arrival_ns = arrival;
+	sample->sequence = gdev->head;
+	sample->raw = raw;
+	sample->rolling_counter = rolling_counter;
+	sample->flags = flags;
+	sample->mdeg = mdeg;
+	gdev->head++;
+
+	write_seqcount_begin(&gdev->reading_seq);
+	gdev->reading.timestamp_ns = timestamp;
+	gdev->reading.sequence = sample->sequence;
+	gdev->reading.raw = raw;
+	gdev->reading.rolling_counter = rolling_counter;
+	gdev->reading.mdeg = mdeg;
+	write_seqcount_end(&gdev->reading_seq);
+
+	if (!gdev->have_history || raw > gdev->highest)
+		gdev->highest = raw;
+	if (!gdev->have_history || raw < gdev->lowest)
+		gdev->lowest = raw;
+	gdev->have_history = true;
+
+	for (i = 0; i < gdev->nr_windows; ++i)
+		window_add(&gdev->windows[i], timestamp, raw);
+
+	if (gdev->indio_dev && iio_buffer_enabled(gdev->indio_dev))
+		iio_push_sample(gdev, raw, timestamp);
+
+	/* publish the record to mmap() readers only once it is complete */
+	smp_store_release(&gdev->ring_hdr->head, gdev->head);
+
+	trace_gotemp_sample(&gdev->interface->dev, sample->sequence, raw,
+			    rolling_counter, flags);
+}
+
+/*
+ * Work out when the last measurement of a packet was taken.  The device
+ * takes one every period_ns, so counting the measurements since the last
+ * packet (including those in packets that got lost) predicts it.  The
+ * packet can't have arrived before it was measured, so an arrival earlier
+ * than the prediction pulls the prediction back; a later one is mostly
+ * USB scheduling jitter and only nudges it forward.
+ *
+ * Called with gdev->lock held.
+ */
+static u64 packet_timestamp(struct gotemp *gdev, u64 arrival,
+			    unsigned int count, unsigned int lost)
+{
+	u64 predicted;
+
+	if (!gdev->ts_synced) {
+		gdev->ts_synced = true;
+		gdev->ts_anchor = arrival;
+		return arrival;
+	}
+
+	predicted = gdev->ts_anchor + gdev->period_ns *
+		    (lost * gdev->last_count + count);
+
+	if (arrival <= predicted)
+		gdev->ts_anchor = arrival;
+	else if (arrival - predicted >
+		 GOTEMP_TS_RESYNC_PERIODS * gdev->period_ns)
+		gdev->ts_anchor = arrival;
+	else
+		gdev->ts_anchor = predicted +
+			((arrival - predicted) >> GOTEMP_TS_CREEP_SHIFT);
+
+	return gdev->ts_anchor;
+}
+
+/*
+ * Every packet carries between one and three measurements and a counter
+ * that the device bumps once per packet, so a jump in the counter tells
+ * us how many packets never made it to us.
+ */
+static void decode_measurements(struct gotemp *gdev, unsigned char *data,
+				int length, u64 arrival)
+{
+	struct measurement_packet *measurement =
+		(struct measurement_packet *)data;
+	int count = measurement->measurements_in_packet;
+	__le16 *values = (__le16 *)(data + offsetof(struct measurement_packet,
+						    measurement0));
+	unsigned long flags;
+	u8 sample_flags = 0;
+	u8 lost = 0;
+	u64 last, timestamp, earliest;
+	u64 period_ns;
+	unsigned int samples;
+	s16 raw = 0;
+	int i;
+
+	if (count < 1 || count > MAX_MEASUREMENTS_IN_PACKET ||
+	    length < offsetof(struct measurement_packet, measurement0) +
+		     count * sizeof(__le16)) {
+		dev_dbg(&gdev->udev->dev,
+			"bogus packet, %d measurements in %d bytes\n",
+			count, length);
+		return;
+	}
+
+	spin_lock_irqsave(&gdev->lock, flags);
+	gdev->packets++;
+	if (gdev->have_counter) {
+		lost = measurement->rolling_counter - gdev->last_counter - 1;
+		if (lost) {
+			gdev->lost_packets += lost;
+			sample_flags = GOTEMP_SAMPLE_GAP;
+			this_cpu_inc(gdev->dstats->gaps);
+			this_cpu_add(gdev->dstats->lost_packets, lost);
+		}
+		hist_add(&gdev->dstats->interval,
+			 arrival - gdev->last_arrival);
+	}
+	gdev->last_arrival = arrival;
+	gdev->last_counter = measurement->rolling_counter;
+	gdev->have_counter = true;
+
+	/* the measurements are period_ns apart, ending with the last one */
+	earliest = gdev->last_ts + 1;
+	last = packet_timestamp(gdev, arrival, count, lost);
+	/* measurements since the last packet, including any we lost */
+	samples = lost * gdev->last_count + count;
+	gdev->last_count = count;
+
+	for (i = 0; i < count; ++i) {
+		raw = le16_to_cpu(values[i]);
+		timestamp = last - (count - 1 - i) * gdev->period_ns;
+		/* never let a resync make time go backwards */
+		timestamp = max(timestamp, earliest);
+		earliest = timestamp + 1;
+		push_sample(gdev, timestamp, arrival, raw,
+			    measurement->rolling_counter, sample_flags);
+		sample_flags = 0;
+	}
+	gdev->last_ts = earliest - 1;
+	period_ns = adapt_period(gdev, raw, samples);
+	spin_unlock_irqrestore(&gdev->lock, flags);
+
+	wake_up_interruptible(&gdev->read_wait);
+
+	/* we are in interrupt context, so don't wait for a free slot */
+	if (period_ns && set_period(gdev, period_ns, GOTEMP_CMD_ATOMIC)) {
+		spin_lock_irqsave(&gdev->lock, flags);
+		gdev->period_change_pending = false;
+		spin_unlock_irqrestore(&gdev->lock, flags);
+	}
+}
+
+static void read_int_callback(struct urb *urb)
+{
+	struct gotemp *gdev = urb->context;
+	u64 arrival = ktime_get_boottime_ns();
+	int retval;
+
+	trace_gotemp_urb_complete(urb);
+	this_cpu_inc(gdev->dstats->completions);
+
+	switch (urb->status) {
+	case 0:
+		this_cpu_add(gdev->dstats->bytes, urb->actual_length);
+		/* success, whatever went wrong before is over */
+		if (unlikely(READ_ONCE(gdev->retries)))
+			WRITE_ONCE(gdev->retries, 0);
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		/* this urb is terminated, or the device is gone, clean up */
+		dev_dbg(&urb->dev->dev,
+			"%s - urb shutting down with status: %d\n",
+			__func__, urb->status);
+		return;
+	default:
+		/* -EPIPE stalls, the rest are errors on the wire */
+		urb_error(gdev, urb, urb->status);
+		return;
+	}
+
+	if (urb->actual_length &&
+	    (*(u8 *)urb->transfer_buffer & PACKET_TYPE_MASK) ==
+	    PACKET_TYPE_CMD_RESPONSE) {
+		handle_response(gdev, urb->transfer_buffer,
+				urb->actual_length);
+	} else if (READ_ONCE(gdev->state) == GOTEMP_STATE_RUNNING) {
+		decode_measurements(gdev, urb->transfer_buffer,
+				    urb->actual_length, arrival);
+	} else {
+		/* still flushing, hold off starting until it is quiet */
+		gdev->flushed++;
+		if (!READ_ONCE(gdev->disconnected) &&
+		    time_before(jiffies, gdev->flush_deadline))
+			mod_delayed_work(system_wq, &gdev->init_work,
+					 GOTEMP_FLUSH_QUIET);
+	}
+
+	usb_anchor_urb(urb, &gdev->int_in_anchor);
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval) {
+		usb_unanchor_urb(urb);
+		trace_gotemp_error(&gdev->interface->dev, "resubmit", retval);
+		/* killed or gone, otherwise try again later */
+		if (retval != -EPERM && retval != -ENODEV) {
+			this_cpu_inc(gdev->dstats->resubmit_failures);
+			urb_error(gdev, urb, retval);
+		}
+	}
+}
+
+static int gotemp_open(struct inode *inode, struct file *file)
+{
+	struct gotemp *gdev;
+	struct gotemp_reader *reader;
+	int retval;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	xa_lock(&gotemp_minors);
+	gdev = xa_load(&gotemp_minors, iminor(inode));
+	if (gdev)
+		kref_get(&gdev->kref);
+	xa_unlock(&gotemp_minors);
+	if (!gdev) {
+		kfree(reader);
+		return -ENODEV;
+	}
+
+	/* the device measures for as long as anybody has it open */
+	retval = gotemp_pm_get(gdev);
+	if (retval) {
+		kref_put(&gdev->kref, gotemp_delete);
+		kfree(reader);
+		return retval;
+	}
+
+	reader->gdev = gdev;
+	mutex_init(&reader->mutex);
+	/* a new reader starts with the next sample that comes in */
+	spin_lock_irq(&gdev->lock);
+	reader->pos = gdev->head;
+	spin_unlock_irq(&gdev->lock);
+
+	file->private_data = reader;
+	return stream_open(inode, file);
+}
+
+static int gotemp_release(struct inode *inode, struct file *file)
+{
+	struct gotemp_reader *reader = file->private_data;
+
+	gotemp_pm_put(reader->gdev);
+	kref_put(&reader->gdev->kref, gotemp_delete);
+	kfree(reader);
+	return 0;
+}
+
+static bool gotemp_readable(struct gotemp_reader *reader)
+{
+	struct gotemp *gdev = reader->gdev;
+
+	return READ_ONCE(gdev->head) != reader->pos ||
+	       READ_ONCE(gdev->disconnected);
+}
+
+/*
+ * Copy up to max samples out of the ring.  If the reader fell so far
+ * behind that the ring wrapped, skip to the oldest sample still there
+ * and flag it so userspace knows it missed some.
+ */
+static unsigned int fetch_samples(struct gotemp_reader *reader,
+				  struct gotemp_sample *batch,
+				  unsigned int max)
+{
+	struct gotemp *gdev = reader->gdev;
+	unsigned int n = 0;
+	u8 flags = 0;
+
+	spin_lock_irq(&gdev->lock);
+	if (gdev->head - reader->pos > gdev->ring_size) {
+		reader->pos = gdev->head - gdev->ring_size;
+		flags = GOTEMP_SAMPLE_OVERRUN;
+	}
+	while (n < max && reader->pos != gdev->head) {
+		batch[n++] = gdev->ring[reader->pos & (gdev->ring_size - 1)];
+		reader->pos++;
+	}
+	spin_unlock_irq(&gdev->lock);
+
+	if (n)
+		batch[0].flags |= flags;
+	return n;
+}
+
+static ssize_t gotemp_read(struct file *file, char __user *buffer,
+			   size_t count, loff_t *ppos)
+{
+	struct gotemp_reader *reader = file->private_data;
+	struct gotemp *gdev = reader->gdev;
+	struct gotemp_sample batch[GOTEMP_READ_BATCH];
+	size_t copied = 0;
+	unsigned int n;
+	int retval;
+
+	if (count < sizeof(batch[0]))
+		return -EINVAL;
+
+	retval = mutex_lock_interruptible(&reader->mutex);
+	if (retval)
+		return retval;
+
+	while (!gotemp_readable(reader)) {
+		if (file->f_flags & O_NONBLOCK) {
+			retval = -EAGAIN;
+			goto exit;
+		}
+		retval = wait_event_interruptible(gdev->read_wait,
+						  gotemp_readable(reader));
+		if (retval)
+			goto exit;
+	}
+
+	while (count - copied >= sizeof(batch[0])) {
+		n = min_t(size_t, GOTEMP_READ_BATCH,
+			  (count - copied) / sizeof(batch[0]));
+		n = fetch_samples(reader, batch, n);
+		if (!n)
+			break;
+		if (copy_to_user(buffer + copied, batch, n * sizeof(batch[0]))) {
+			retval = -EFAULT;
+			goto exit;
+		}
+		copied += n * sizeof(batch[0]);
+	}
+
+	/* only report the disconnect once everything buffered is read */
+	retval = copied ? copied : -ENODEV;
+
+exit:
+	mutex_unlock(&reader->mutex);
+	return retval;
+}
+
+static __poll_t gotemp_poll(struct file *file, poll_table *wait)
+{
+	struct gotemp_reader *reader = file->private_data;
+	struct gotemp *gdev = reader->gdev;
+	__poll_t mask = 0;
+
+	poll_wait(file, &gdev->read_wait, wait);
+
+	if (READ_ONCE(gdev->head) != reader->pos)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(gdev->disconnected))
+		mask |= EPOLLHUP | EPOLLERR;
+	return mask;
+}
+
+static long gotemp_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct gotemp_reader *reader = file->private_data;
+	u32 pos;
+
+	switch (cmd) {
+	case GOTEMP_IOC_SET_POS:
+		if (get_user(pos, (u32 __user *)arg))
+			return -EFAULT;
+		if (mutex_lock_interruptible(&reader->mutex))
+			return -ERESTARTSYS;
+		reader->pos = pos;
+		mutex_unlock(&reader->mutex);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int gotemp_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gotemp_reader *reader = file->private_data;
+	struct gotemp *gdev = reader->gdev;
+
+	/* only the driver writes to the ring */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, gdev->ring_hdr, vma->vm_pgoff);
+}
+
+static const struct file_operations gotemp_fops = {
+	.owner =	THIS_MODULE,
+	.open =		gotemp_open,
+	.release =	gotemp_release,
+	.read =		gotemp_read,
+	.poll =		gotemp_poll,
+	.unlocked_ioctl = gotemp_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+	.mmap =		gotemp_mmap,
+};
+
+static ssize_t serial_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct gotemp *gdev = dev_get_drvdata(dev);
+
+	if (!smp_load_acquire(&gdev->have_serial))
+		return -ENODATA;
+	return sprintf(buf, GOTEMP_SERIAL_FMT "\n", gdev->serial);
+}
+static DEVICE_ATTR_RO(serial);
+
+static struct attribute *gotemp_chrdev_attrs[] = {
+	&dev_attr_serial.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(gotemp_chrdev);
+
+/* every event carries the serial number once we know it */
+static int gotemp_chrdev_uevent(const struct device *dev,
+				struct kobj_uevent_env *env)
+{
+	struct gotemp *gdev = dev_get_drvdata(dev);
+
+	if (!smp_load_acquire(&gdev->have_serial))
+		return 0;
+	return add_uevent_var(env, "GOTEMP_SERIAL=" GOTEMP_SERIAL_FMT,
+			      gdev->serial);
+}
+
+static const struct class gotemp_chrdev_class = {
+	.name =		"gotemp",
+	.dev_groups =	gotemp_chrdev_groups,
+	.dev_uevent =	gotemp_chrdev_uevent,
+};
+
+static int gotemp_chrdev_register(struct gotemp *gdev)
+{
+	struct device *chrdev;
+	int retval;
+
+	retval = xa_alloc(&gotemp_minors, &gdev->minor, gdev,
+			  XA_LIMIT(0, GOTEMP_MAX_DEVICES - 1), GFP_KERNEL);
+	if (retval)
+		return retval;
+
+	chrdev = device_create(&gotemp_chrdev_class, &gdev->interface->dev,
+			       MKDEV(MAJOR(gotemp_devt), gdev->minor), gdev,
+			       "gotemp%u", gdev->minor);
+	if (IS_ERR(chrdev)) {
+		xa_erase(&gotemp_minors, gdev->minor);
+		return PTR_ERR(chrdev);
+	}
+
+	mutex_lock(&gotemp_list_lock);
+	gdev->chrdev = chrdev;
+	mutex_unlock(&gotemp_list_lock);
+	return 0;
+}
+
+/* no new opens after this, open files keep working until closed */
+static void gotemp_chrdev_unregister(struct gotemp *gdev)
+{
+	mutex_lock(&gotemp_list_lock);
+	if (gdev->have_serial)
+		hash_del(&gdev->serial_node);
+	gdev->chrdev = NULL;
+	mutex_unlock(&gotemp_list_lock);
+
+	device_destroy(&gotemp_chrdev_class,
+		       MKDEV(MAJOR(gotemp_devt), gdev->minor));
+	xa_erase(&gotemp_minors, gdev->minor);
+}
+
+/*
+ * The same samples through the industrial I/O subsystem: in_temp_raw
+ * reads the newest one, and the buffer gets every one of them as they
+ * are decoded.  The device hands us up to three samples per packet, so
+ * the buffer behaves like a small hardware fifo.  scale and offset are
+ * the nominal ones, in_temp_input has the device's own calibration.
+ */
+static const struct iio_chan_spec gotemp_iio_channels[] = {
+	{
+		.type = IIO_TEMP,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |
+				      BIT(IIO_CHAN_INFO_PROCESSED) |
+				      BIT(IIO_CHAN_INFO_SCALE) |
+				      BIT(IIO_CHAN_INFO_OFFSET),
+		.scan_index = 0,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 16,
+			.storagebits = 16,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(1),
+};
+
+static int gotemp_iio_read_raw(struct iio_dev *indio_dev,
+			       struct iio_chan_spec const *chan,
+			       int *val, int *val2, long mask)
+{
+	struct gotemp *gdev = *(struct gotemp **)iio_priv(indio_dev);
+	struct gotemp_reading reading;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		gotemp_touch(gdev);
+		get_reading(gdev, &reading);
+		*val = reading.raw;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_PROCESSED:
+		/* with the device's calibration */
+		gotemp_touch(gdev);
+		get_reading(gdev, &reading);
+		*val = reading.mdeg;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		/* 1/128 degree C per count, in millidegrees */
+		*val = 1000;
+		*val2 = 7;
+		return IIO_VAL_FRACTIONAL_LOG2;
+	case IIO_CHAN_INFO_OFFSET:
+		*val = 0;
+		return IIO_VAL_INT;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* like an open file, an enabled buffer keeps the device measuring */
+static int gotemp_iio_preenable(struct iio_dev *indio_dev)
+{
+	struct gotemp *gdev = *(struct gotemp **)iio_priv(indio_dev);
+
+	return gotemp_pm_get(gdev);
+}
+
+static int gotemp_iio_postdisable(struct iio_dev *indio_dev)
+{
+	struct gotemp *gdev = *(struct gotemp **)iio_priv(indio_dev);
+
+	gotemp_pm_put(gdev);
+	return 0;
+}
+
+static const struct iio_buffer_setup_ops gotemp_iio_buffer_ops = {
+	.preenable = gotemp_iio_preenable,
+	.postdisable = gotemp_iio_postdisable,
+};
+
+static const struct iio_info gotemp_iio_info = {
+	.read_raw = gotemp_iio_read_raw,
+};
+
+IIO_STATIC_CONST_DEVICE_ATTR(hwfifo_watermark_min, "1");
+IIO_STATIC_CONST_DEVICE_ATTR(hwfifo_watermark_max,
+			     __stringify(MAX_MEASUREMENTS_IN_PACKET));
+
+static const struct iio_dev_attr *gotemp_fifo_attributes[] = {
+	&iio_dev_attr_hwfifo_watermark_min,
+	&iio_dev_attr_hwfifo_watermark_max,
+	NULL,
+};
+
+static int gotemp_iio_register(struct gotemp *gdev)
+{
+	struct device *dev = &gdev->interface->dev;
+	struct iio_dev *indio_dev;
+	int retval;
+
+	indio_dev = devm_iio_device_alloc(dev, sizeof(gdev));
+	if (!indio_dev)
+		return -ENOMEM;
+	*(struct gotemp **)iio_priv(indio_dev) = gdev;
+
+	indio_dev->name = "gotemp";
+	indio_dev->info = &gotemp_iio_info;
+	indio_dev->channels = gotemp_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(gotemp_iio_channels);
+	indio_dev->modes = INDIO_DIRECT_MODE;
+
+	retval = devm_iio_kfifo_buffer_setup_ext(dev, indio_dev,
+						 &gotemp_iio_buffer_ops,
+						 gotemp_fifo_attributes);
+	if (retval)
+		return retval;
+
+	retval = devm_iio_device_register(dev, indio_dev);
+	if (retval)
+		return retval;
+
+	gdev->indio_dev = indio_dev;
+	return 0;
+}
+
+/*
+ * hwmon sees the same cached samples, so any number of sensors scrapers
+ * cost us a memory read each and never a trip over the bus.
+ */
+static umode_t gotemp_hwmon_is_visible(const void *data,
+				       enum hwmon_sensor_types type,
+				       u32 attr, int channel)
+{
+	switch (attr) {
+	case hwmon_temp_input:
+	case hwmon_temp_highest:
+	case hwmon_temp_lowest:
+	case hwmon_temp_min_alarm:
+	case hwmon_temp_max_alarm:
+		return S_IRUGO;
+	case hwmon_temp_min:
+	case hwmon_temp_max:
+	case hwmon_temp_min_hyst:
+	case hwmon_temp_max_hyst:
+		return S_IRUGO | S_IWUSR;
+	case hwmon_temp_reset_history:
+		return S_IWUSR;
+	default:
+		return 0;
+	}
+}
+
+static int gotemp_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			     u32 attr, int channel, long *val)
+{
+	struct gotemp *gdev = dev_get_drvdata(dev);
+	struct gotemp_reading reading;
+	int retval = 0;
+
+	gotemp_touch(gdev);
+
+	/* the one everybody scrapes doesn't need the lock */
+	if (attr == hwmon_temp_input) {
+		get_reading(gdev, &reading);
+		if (!reading.timestamp_ns)
+			return -ENODATA;
+		*val = reading.mdeg;
+		return 0;
+	}
+
+	spin_lock_irq(&gdev->lock);
+	switch (attr) {
+	/* only the history needs a sample, the limits are there from probe */
+	case hwmon_temp_highest:
+		if (!gdev->have_history)
+			retval = -ENODATA;
+		else
+			*val = raw_to_mdeg(&gdev->cal, gdev->highest);
+		break;
+	case hwmon_temp_lowest:
+		if (!gdev->have_history)
+			retval = -ENODATA;
+		else
+			*val = raw_to_mdeg(&gdev->cal, gdev->lowest);
+		break;
+	case hwmon_temp_min:
+		*val = gdev->min_mdeg;
+		break;
+	case hwmon_temp_max:
+		*val = gdev->max_mdeg;
+		break;
+	case hwmon_temp_min_hyst:
+		*val = gdev->min_hyst_mdeg;
+		break;
+	case hwmon_temp_max_hyst:
+		*val = gdev->max_hyst_mdeg;
+		break;
+	case hwmon_temp_min_alarm:
+		*val = !!(gdev->alarms & GOTEMP_ALARM_LOW);
+		break;
+	case hwmon_temp_max_alarm:
+		*val = !!(gdev->alarms & GOTEMP_ALARM_HIGH);
+		break;
+	default:
+		retval = -EOPNOTSUPP;
+	}
+	spin_unlock_irq(&gdev->lock);
+	return retval;
+}
+
+static int gotemp_hwmon_write(struct device *dev,
+			      enum hwmon_sensor_types type,
+			      u32 attr, int channel, long val)
+{
+	struct gotemp *gdev = dev_get_drvdata(dev);
+	int retval = 0;
 
-/* table of devices that work with this driver */
-static struct usb_device_id id_table[] = {
-	{ USB_DEVICE(VENDOR_ID, PRODUCT_ID) },
-	{ },
+	val = clamp_val(val, INT_MIN, INT_MAX);
+
+	spin_lock_irq(&gdev->lock);
+	switch (attr) {
+	/* moving a limit takes its hysteresis along, as far as an int goes */
+	case hwmon_temp_min:
+		gdev->min_hyst_mdeg = clamp_val((s64)gdev->min_hyst_mdeg + val -
+						gdev->min_mdeg, INT_MIN, INT_MAX);
+		gdev->min_mdeg = val;
+		break;
+	case hwmon_temp_max:
+		gdev->max_hyst_mdeg = clamp_val((s64)gdev->max_hyst_mdeg + val -
+						gdev->max_mdeg, INT_MIN, INT_MAX);
+		gdev->max_mdeg = val;
+		break;
+	case hwmon_temp_min_hyst:
+		gdev->min_hyst_mdeg = max_t(long, val, gdev->min_mdeg);
+		break;
+	case hwmon_temp_max_hyst:
+		gdev->max_hyst_mdeg = min_t(long, val, gdev->max_mdeg);
+		break;
+	case hwmon_temp_reset_history:
+		/* start over from the newest sample */
+		gdev->highest = gdev->reading.raw;
+		gdev->lowest = gdev->reading.raw;
+		break;
+	default:
+		retval = -EOPNOTSUPP;
+	}
+	/* the newest sample may be on the other side of the new limits */
+	if (!retval && gdev->have_history && !READ_ONCE(gdev->disconnected))
+		check_alarms(gdev, gdev->reading.mdeg);
+	spin_unlock_irq(&gdev->lock);
+
+	return retval;
+}
+
+static const struct hwmon_ops gotemp_hwmon_ops = {
+	.is_visible = gotemp_hwmon_is_visible,
+	.read = gotemp_hwmon_read,
+	.write = gotemp_hwmon_write,
 };
-MODULE_DEVICE_TABLE(usb, id_table);
 
-struct gotemp {
-	struct usb_device *udev;
-	int temperature;
-	unsigned char *int_in_buffer;
-	__u8 int_in_endpointAddr;
-	struct urb *int_in_urb;
+static const struct hwmon_channel_info * const gotemp_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_MIN | HWMON_T_MAX |
+			   HWMON_T_MIN_HYST | HWMON_T_MAX_HYST |
+			   HWMON_T_MIN_ALARM | HWMON_T_MAX_ALARM |
+			   HWMON_T_HIGHEST | HWMON_T_LOWEST |
+			   HWMON_T_RESET_HISTORY),
+	NULL
 };
 
-#define CMD_ID_GET_STATUS			0x10
-#define CMD_ID_WRITE_LOCAL_NV_MEM_1BYTE		0x11
-#define CMD_ID_WRITE_LOCAL_NV_MEM_2BYTES	0x12
-#define CMD_ID_WRITE_LOCAL_NV_MEM_3BYTES	0x13
-#define CMD_ID_WRITE_LOCAL_NV_MEM_4BYTES	0x14
-#define CMD_ID_WRITE_LOCAL_NV_MEM_5BYTES	0x15
-#define CMD_ID_WRITE_LOCAL_NV_MEM_6BYTES	0x16
-#define CMD_ID_READ_LOCAL_NV_MEM		0x17
-#define CMD_ID_START_MEASUREMENTS		0x18
-#define CMD_ID_STOP_MEASUREMENTS		0x19
-#define CMD_ID_INIT				0x1A
-#define CMD_ID_SET_MEASUREMENT_PERIOD		0x1B
-#define CMD_ID_GET_MEASUREMENT_PERIOD		0x1C
-#define CMD_ID_SET_LED_STATE			0x1D
-#define CMD_ID_GET_LED_STATE			0x1E
-#define CMD_ID_GET_SERIAL_NUMBER		0x20
+static const struct hwmon_chip_info gotemp_hwmon_chip_info = {
+	.ops = &gotemp_hwmon_ops,
+	.info = gotemp_hwmon_info,
+};
 
-struct output_packet {
-	u8	cmd;
-	u8	params[7];
-} __attribute__ ((packed));
+/*
+ * Tell everybody who might be waiting that an alarm went on or off:
+ * pollers of the alarm file, pollers of the hwmon alarm files, and
+ * udev, with the new state in GOTEMP_ALARM and the temperature that
+ * caused it in GOTEMP_TEMPERATURE.
+ */
+static void alarm_work_handler(struct work_struct *work)
+{
+	struct gotemp *gdev = container_of(work, struct gotemp, alarm_work);
+	struct kobject *kobj = &gdev->interface->dev.kobj;
+	char alarm_env[32], temp_env[32];
+	char *envp[] = { alarm_env, temp_env, NULL };
+	u8 alarms, changed;
+	int mdeg;
 
-struct measurement_packet {
-	u8	measurements_in_packet;
-	u8	rolling_counter;
-	__le16	measurement0;
-	__le16	measurement1;
-	__le16	measurement2;
-} __attribute__ ((packed));
+	spin_lock_irq(&gdev->lock);
+	alarms = gdev->alarms;
+	changed = alarms ^ gdev->alarms_reported;
+	gdev->alarms_reported = alarms;
+	mdeg = gdev->reading.mdeg;
+	spin_unlock_irq(&gdev->lock);
+
+	if (!changed || READ_ONCE(gdev->disconnected))
+		return;
+
+	sysfs_notify(kobj, NULL, "alarm");
+	if (gdev->hwmon_dev && (changed & GOTEMP_ALARM_LOW))
+		hwmon_notify_event(gdev->hwmon_dev, hwmon_temp,
+				   hwmon_temp_min_alarm, 0);
+	if (gdev->hwmon_dev && (changed & GOTEMP_ALARM_HIGH))
+		hwmon_notify_event(gdev->hwmon_dev, hwmon_temp,
+				   hwmon_temp_max_alarm, 0);
+
+	snprintf(alarm_env, sizeof(alarm_env), "GOTEMP_ALARM=%s",
+		 alarm_names[alarms]);
+	snprintf(temp_env, sizeof(temp_env), "GOTEMP_TEMPERATURE=%d", mdeg);
+	kobject_uevent_env(kobj, KOBJ_CHANGE, envp);
+}
 
-static int send_cmd(struct gotemp *gdev, u8 cmd)
+static void gotemp_devm_put(void *data)
 {
-	struct output_packet *pkt;
-	int retval;
+	struct gotemp *gdev = data;
 
-	pkt = kzalloc(sizeof(*pkt), GFP_KERNEL);
-	if (!pkt)
-		return -ENOMEM;
-	pkt->cmd = cmd;
-
-	retval = usb_control_msg(gdev->udev,
-				 usb_sndctrlpipe(gdev->udev, 0),
-				 0x09,		/* bRequest = SET_REPORT */
-				 0x21,		/* bRequestType = 00100001 */
-				 0x0200,	/* or is it 0x0002? */
-				 0x0000,	/* interface 0 */
-				 pkt, sizeof(*pkt), 10000);
-	dev_dbg(&gdev->udev->dev, "retval=%d\n", retval);
-	if (retval == sizeof(*pkt))
-		retval = 0;
-
-	kfree(pkt);
-	return retval;
+	kref_put(&gdev->kref, gotemp_delete);
 }
 
-static void init_dev(struct gotemp *gdev)
+/*
+ * The iio and hwmon devices go away with the interface's devres, after
+ * gotemp_disconnect(), so together they hold a reference on gdev.
+ */
+static int gotemp_devm_register(struct gotemp *gdev)
 {
+	struct device *dev = &gdev->interface->dev;
+	struct device *hwmon_dev;
 	int retval;
 
-	/* First send an init message */
-	send_cmd(gdev, CMD_ID_INIT);
+	kref_get(&gdev->kref);
+	retval = devm_add_action_or_reset(dev, gotemp_devm_put, gdev);
+	if (retval)
+		return retval;
 
-	/* hack hack hack */
-	/* problem is, we want a usb_interrupt_msg() call to read the interrupt
-	 * endpoint right now.  only after it is flushed, can we properly start
-	 * up the measurements.  */
-	msleep(1000);
+	retval = gotemp_iio_register(gdev);
+	if (retval) {
+		dev_err(dev, "Not able to register iio device\n");
+		return retval;
+	}
 
-	/* kick off interrupt urb */
-	retval = usb_submit_urb(gdev->int_in_urb, GFP_KERNEL);
-	if (retval)
-		dev_err(&gdev->udev->dev,
-			"%s - Error %d submitting interrupt urb\n",
-			__func__, retval);
+	hwmon_dev = devm_hwmon_device_register_with_info(dev, "gotemp", gdev,
+						&gotemp_hwmon_chip_info, NULL);
+	if (IS_ERR(hwmon_dev)) {
+		dev_err(dev, "Not able to register hwmon device\n");
+		return PTR_ERR(hwmon_dev);
+	}
+	gdev->hwmon_dev = hwmon_dev;
+	return 0;
+}
+
+/*
+ * /dev/gotemp_snapshot reads back one line for every attached device
+ * with its newest sample.  The samples are all grabbed first, within a
+ * few microseconds of each other, and only printed after.  Reading from
+ * offset zero again (pread, or lseek first) takes a fresh snapshot.
+ */
+static int snapshot_show(struct seq_file *m, void *v)
+{
+	struct gotemp_reading *rows;
+	struct gotemp *gdev;
+	unsigned int n = 0;
+	unsigned int i;
+	u64 now;
+
+	mutex_lock(&gotemp_list_lock);
+	list_for_each_entry(gdev, &gotemp_list, list)
+		n++;
+
+	rows = kmalloc_array(max(n, 1U), sizeof(*rows), GFP_KERNEL);
+	if (!rows) {
+		mutex_unlock(&gotemp_list_lock);
+		return -ENOMEM;
+	}
 
-	msleep(3000);
-	send_cmd(gdev, CMD_ID_START_MEASUREMENTS);
+	/* the dashboard counts as a user, like the sysfs files do */
+	list_for_each_entry(gdev, &gotemp_list, list)
+		gotemp_touch(gdev);
+
+	i = 0;
+	now = ktime_get_boottime_ns();
+	list_for_each_entry(gdev, &gotemp_list, list)
+		get_reading(gdev, &rows[i++]);
+
+	seq_printf(m, "# captured_ns %llu\n", now);
+	seq_puts(m, "# device sequence raw timestamp_ns\n");
+
+	i = 0;
+	list_for_each_entry(gdev, &gotemp_list, list) {
+		seq_printf(m, "%s ", dev_name(&gdev->interface->dev));
+		/* no timestamp means nothing has come in yet */
+		if (rows[i].timestamp_ns)
+			seq_printf(m, "%u %d %llu\n", rows[i].sequence,
+				   rows[i].raw, rows[i].timestamp_ns);
+		else
+			seq_puts(m, "- - -\n");
+		i++;
+	}
+	mutex_unlock(&gotemp_list_lock);
+
+	kfree(rows);
+	return 0;
 }
 
-static ssize_t show_temp(struct device *dev, struct device_attribute *attr,
-			 char *buf)
+static int snapshot_open(struct inode *inode, struct file *file)
 {
-	struct usb_interface *intf = to_usb_interface(dev);
-	struct gotemp *gdev = usb_get_intfdata(intf);
+	return single_open(file, snapshot_show, NULL);
+}
+
+/* which /dev/gotempN a probe is, by serial number */
+static long snapshot_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct gotemp_serial_lookup lookup;
+	struct gotemp *gdev;
+
+	switch (cmd) {
+	case GOTEMP_IOC_FIND_SERIAL:
+		if (copy_from_user(&lookup, (void __user *)arg,
+				   sizeof(lookup)))
+			return -EFAULT;
+
+		mutex_lock(&gotemp_list_lock);
+		gdev = gotemp_find_serial(lookup.serial);
+		if (gdev)
+			lookup.minor = gdev->minor;
+		mutex_unlock(&gotemp_list_lock);
+		if (!gdev)
+			return -ENOENT;
 
-	return sprintf(buf, "%d\n", gdev->temperature);
+		if (copy_to_user((void __user *)arg, &lookup, sizeof(lookup)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
 }
 
-static DEVICE_ATTR(temperature, S_IRUGO, show_temp, NULL);
+static const struct file_operations snapshot_fops = {
+	.owner =	THIS_MODULE,
+	.open =		snapshot_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+	.unlocked_ioctl = snapshot_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+};
 
-static void read_int_callback(struct urb *urb)
+static struct miscdevice snapshot_dev = {
+	.minor =	MISC_DYNAMIC_MINOR,
+	.name =		"gotemp_snapshot",
+	.fops =		&snapshot_fops,
+	.mode =		S_IRUGO,
+};
+
+/*
+ * debugfs, a directory per device under gotemp/, named after the
+ * interface.  The counters are added up over all cpus when read, and
+ * anything written to reset zeroes them.
+ */
+static void debug_sum(struct gotemp *gdev, struct gotemp_debug_stats *sum)
 {
-	struct gotemp *gdev = urb->context;
-	unsigned char *data = urb->transfer_buffer;
-	struct measurement_packet *measurement = urb->transfer_buffer;
-	int retval;
+	const u64 *from;
+	u64 *to = (u64 *)sum;
+	int cpu;
 	int i;
 
-	switch (urb->status) {
-	case 0:
-		/* success */
-		break;
-	case -ECONNRESET:
-	case -ENOENT:
-	case -ESHUTDOWN:
-		/* this urb is terminated, clean up */
-		dbg("%s - urb shutting down with status: %d",
-		    __func__, urb->status);
-		return;
-	default:
-		dbg("%s - nonzero urb status received: %d",
-		    __func__, urb->status);
-		goto exit;
+	BUILD_BUG_ON(sizeof(*sum) % sizeof(u64));
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		from = (const u64 *)per_cpu_ptr(gdev->dstats, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); ++i)
+			to[i] += READ_ONCE(from[i]);
 	}
+}
+
+static int debug_stats_show(struct seq_file *m, void *v)
+{
+	struct gotemp *gdev = m->private;
+	struct gotemp_debug_stats *sum;
+	int i;
 
-	dev_info(&urb->dev->dev, "int read data: ");
-	for (i = 0; i < urb->actual_length; ++i)
-		printk("%02x ", data[i]);
-	printk("\n");
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	debug_sum(gdev, sum);
 
-	dev_dbg(&urb->dev->dev, "counter %d, temperature=%d\n",
-		 measurement->rolling_counter,
-		 measurement->measurement0);
-	gdev->temperature = le16_to_cpu(measurement->measurement0);
+	seq_printf(m, "completions: %llu\n", sum->completions);
+	seq_printf(m, "bytes: %llu\n", sum->bytes);
+	seq_printf(m, "resubmit_failures: %llu\n", sum->resubmit_failures);
+	seq_printf(m, "resets: %llu\n", sum->resets);
+	seq_printf(m, "gaps: %llu\n", sum->gaps);
+	seq_printf(m, "lost_packets: %llu\n", sum->lost_packets);
+	seq_printf(m, "cmds: %llu\n", sum->cmds);
+	seq_printf(m, "cmd_errors: %llu\n", sum->cmd_errors);
+	seq_printf(m, "cmd_timeouts: %llu\n", sum->cmd_timeouts);
+	for (i = 0; i < ARRAY_SIZE(gotemp_urb_errnos); ++i)
+		if (sum->errors[i])
+			seq_printf(m, "errors %pe: %llu\n",
+				   ERR_PTR(-gotemp_urb_errnos[i]),
+				   sum->errors[i]);
+	if (sum->errors[i])
+		seq_printf(m, "errors other: %llu\n", sum->errors[i]);
 
-exit:
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval)
-		dev_err(&urb->dev->dev,
-			"%s - Error %d submitting interrupt urb\n",
-			__func__, retval);
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(debug_stats);
+
+/* one line per bucket that has anything in it, from the shortest time */
+static void debug_hist_show(struct seq_file *m, const char *name,
+			    const struct gotemp_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "%s: %llu, mean %llu ns\n", name, hist->count,
+		   hist->count ? div64_u64(hist->sum_ns, hist->count) : 0);
+	for (i = 0; i < GOTEMP_HIST_BUCKETS; ++i)
+		if (hist->buckets[i])
+			seq_printf(m, "  >= %11llu ns: %llu\n",
+				   i ? 1ULL << (i - 1) : 0, hist->buckets[i]);
+}
+
+static int debug_histograms_show(struct seq_file *m, void *v)
+{
+	struct gotemp *gdev = m->private;
+	struct gotemp_debug_stats *sum;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	debug_sum(gdev, sum);
+
+	debug_hist_show(m, "interval", &sum->interval);
+	debug_hist_show(m, "cmd_latency", &sum->cmd_latency);
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(debug_histograms);
+
+/*
+ * Counts racing with this on other cpus may survive it, which is fine
+ * for finding out what a device has been up to since.
+ */
+static ssize_t debug_reset_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct gotemp *gdev = file->private_data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(gdev->dstats, cpu), 0,
+		       sizeof(struct gotemp_debug_stats));
+	return count;
+}
+
+static const struct file_operations debug_reset_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.write =	debug_reset_write,
+	.llseek =	noop_llseek,
+};
+
+static void gotemp_debugfs_register(struct gotemp *gdev)
+{
+	gdev->debugfs_dir = debugfs_create_dir(dev_name(&gdev->interface->dev),
+					       gotemp_debugfs_root);
+	debugfs_create_file("stats", S_IRUSR, gdev->debugfs_dir, gdev,
+			    &debug_stats_fops);
+	debugfs_create_file("histograms", S_IRUSR, gdev->debugfs_dir, gdev,
+			    &debug_histograms_fops);
+	debugfs_create_file("reset", S_IWUSR, gdev->debugfs_dir, gdev,
+			    &debug_reset_fops);
 }
 
 static int gotemp_probe(struct usb_interface *interface,
@@ -181,6 +3302,7 @@ static int gotemp_probe(struct usb_interface *interface,
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint = NULL;
 	size_t buffer_size = 0;
+	struct urb *urb;
 
 	gdev = kzalloc(sizeof(*gdev), GFP_KERNEL);
 	if (gdev == NULL) {
@@ -188,7 +3310,56 @@ static int gotemp_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	kref_init(&gdev->kref);
+	spin_lock_init(&gdev->lock);
+	seqcount_spinlock_init(&gdev->reading_seq, &gdev->lock);
+	init_waitqueue_head(&gdev->read_wait);
+	init_usb_anchor(&gdev->int_in_anchor);
+	INIT_DELAYED_WORK(&gdev->init_work, init_work_handler);
+	INIT_DELAYED_WORK(&gdev->retry_work, retry_work_handler);
+	ratelimit_state_init(&gdev->err_ratelimit, DEFAULT_RATELIMIT_INTERVAL,
+			     DEFAULT_RATELIMIT_BURST);
+	gdev->state = GOTEMP_STATE_INIT;
+	gdev->period_ns = GOTEMP_DEFAULT_PERIOD_NS;
+	gdev->adaptive_min_ns = GOTEMP_MIN_PERIOD_NS;
+	gdev->min_mdeg = GOTEMP_RANGE_MIN_MDEG;
+	gdev->max_mdeg = GOTEMP_RANGE_MAX_MDEG;
+	gdev->min_hyst_mdeg = GOTEMP_RANGE_MIN_MDEG + GOTEMP_DEFAULT_HYST_MDEG;
+	gdev->max_hyst_mdeg = GOTEMP_RANGE_MAX_MDEG - GOTEMP_DEFAULT_HYST_MDEG;
+	gdev->cal = gotemp_nominal_cal;
+	INIT_WORK(&gdev->alarm_work, alarm_work_handler);
+	init_windows(gdev);
+	spin_lock_init(&gdev->cmd_lock);
+	INIT_LIST_HEAD(&gdev->cmd_free);
+	INIT_LIST_HEAD(&gdev->cmd_queue);
+	init_waitqueue_head(&gdev->cmd_slot_wait);
+	INIT_DELAYED_WORK(&gdev->cmd_timeout_work, cmd_timeout_handler);
+	init_usb_anchor(&gdev->cmd_anchor);
+	mutex_init(&gdev->pm_mutex);
+	mutex_init(&gdev->nv_mutex);
 	gdev->udev = usb_get_dev(udev);
+	gdev->interface = interface;
+
+	gdev->dstats = alloc_percpu(struct gotemp_debug_stats);
+	if (!gdev->dstats)
+		goto error;
+
+	gdev->ring_size = roundup_pow_of_two(clamp_t(unsigned int, ring_size,
+						     GOTEMP_RING_MIN,
+						     GOTEMP_RING_MAX));
+	BUILD_BUG_ON(sizeof(*gdev->ring_hdr) > GOTEMP_RING_DATA_OFFSET);
+	gdev->ring_hdr = vmalloc_user(GOTEMP_RING_DATA_OFFSET +
+				      gdev->ring_size * sizeof(*gdev->ring));
+	if (!gdev->ring_hdr) {
+		dev_err(&interface->dev, "Could not allocate sample ring\n");
+		goto error;
+	}
+	gdev->ring_hdr->magic = GOTEMP_RING_MAGIC;
+	gdev->ring_hdr->version = GOTEMP_RING_VERSION;
+	gdev->ring_hdr->record_size = sizeof(*gdev->ring);
+	gdev->ring_hdr->ring_size = gdev->ring_size;
+	gdev->ring_hdr->data_offset = GOTEMP_RING_DATA_OFFSET;
+	gdev->ring = (void *)gdev->ring_hdr + GOTEMP_RING_DATA_OFFSET;
 
 	/* find the one control endpoint of this device */
 	iface_desc = interface->cur_altsetting;
@@ -198,12 +3369,6 @@ static int gotemp_probe(struct usb_interface *interface,
 		if (usb_endpoint_is_int_in(endpoint)) {
 			buffer_size = le16_to_cpu(endpoint->wMaxPacketSize);
 			gdev->int_in_endpointAddr = endpoint->bEndpointAddress;
-			gdev->int_in_buffer = kmalloc(buffer_size, GFP_KERNEL);
-			if (!gdev->int_in_buffer) {
-				dev_err(&interface->dev,
-					"Could not allocate buffer");
-				goto error;
-			}
 			break;
 		}
 	}
@@ -213,41 +3378,124 @@ static int gotemp_probe(struct usb_interface *interface,
 		goto error;
 	}
 
-	gdev->int_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!gdev->int_in_urb) {
-		dev_err(&interface->dev, "No free urbs available\n");
+	/*
+	 * the buffers come from coherent memory, so nothing needs to be
+	 * mapped or bounced every time an urb goes out
+	 */
+	gdev->nr_urbs = clamp_t(unsigned int, nr_urbs, 1, GOTEMP_MAX_URBS);
+	gdev->int_in_size = buffer_size;
+	gdev->int_in_buffers = usb_alloc_coherent(udev,
+						  gdev->nr_urbs * buffer_size,
+						  GFP_KERNEL,
+						  &gdev->int_in_dma);
+	if (!gdev->int_in_buffers) {
+		dev_err(&interface->dev, "Could not allocate buffer");
+		goto error;
+	}
+
+	for (i = 0; i < gdev->nr_urbs; ++i) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			dev_err(&interface->dev, "No free urbs available\n");
+			goto error;
+		}
+		gdev->int_in_urbs[i] = urb;
+
+		usb_fill_int_urb(urb, udev,
+				 usb_rcvintpipe(udev,
+						endpoint->bEndpointAddress),
+				 gdev->int_in_buffers + i * buffer_size,
+				 buffer_size, read_int_callback, gdev,
+				 endpoint->bInterval);
+		urb->transfer_dma = gdev->int_in_dma + i * buffer_size;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+
+	/* and the command slots get theirs the same way */
+	gdev->cmd_bufs = usb_alloc_coherent(udev,
+					    GOTEMP_CMD_SLOTS *
+					    sizeof(*gdev->cmd_bufs),
+					    GFP_KERNEL, &gdev->cmd_dma);
+	if (!gdev->cmd_bufs) {
+		dev_err(&interface->dev, "Could not allocate buffer");
 		goto error;
 	}
-	usb_fill_int_urb(gdev->int_in_urb, udev,
-			 usb_rcvintpipe(udev,
-					endpoint->bEndpointAddress),
-			 gdev->int_in_buffer, buffer_size,
-			 read_int_callback, gdev,
-			 endpoint->bInterval);
+
+	gdev->cmd_setup.bRequestType = 0x21;	/* 00100001 */
+	gdev->cmd_setup.bRequest = 0x09;	/* SET_REPORT */
+	gdev->cmd_setup.wValue = cpu_to_le16(0x0200);	/* or is it 0x0002? */
+	gdev->cmd_setup.wIndex = cpu_to_le16(0);	/* interface 0 */
+	gdev->cmd_setup.wLength = cpu_to_le16(sizeof(struct output_packet));
+
+	for (i = 0; i < GOTEMP_CMD_SLOTS; ++i) {
+		struct gotemp_cmd *c = &gdev->cmds[i];
+
+		c->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!c->urb) {
+			dev_err(&interface->dev, "No free urbs available\n");
+			goto error;
+		}
+		c->gdev = gdev;
+		c->pkt = &gdev->cmd_bufs[i];
+		init_completion(&c->done);
+
+		usb_fill_control_urb(c->urb, udev, usb_sndctrlpipe(udev, 0),
+				     (unsigned char *)&gdev->cmd_setup,
+				     c->pkt, sizeof(*c->pkt),
+				     cmd_urb_callback, c);
+		c->urb->transfer_dma = gdev->cmd_dma + i * sizeof(*c->pkt);
+		c->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		list_add_tail(&c->list, &gdev->cmd_free);
+	}
 
 	usb_set_intfdata(interface, gdev);
 
-	init_dev(gdev);
+	retval = sysfs_create_group(&interface->dev.kobj, &gotemp_attr_group);
+	if (retval)
+		goto error;
+
+	retval = gotemp_chrdev_register(gdev);
+	if (retval) {
+		dev_err(&interface->dev,
+			"Not able to get a minor for this device\n");
+		sysfs_remove_group(&interface->dev.kobj, &gotemp_attr_group);
+		goto error;
+	}
+
+	retval = gotemp_devm_register(gdev);
+	if (retval) {
+		gotemp_chrdev_unregister(gdev);
+		sysfs_remove_group(&interface->dev.kobj, &gotemp_attr_group);
+		goto error;
+	}
+
+	gotemp_debugfs_register(gdev);
 
 	/*
-	 * this must come last - after this call the device is active
-	 * if we delayed any initialization until after this, the user
-	 * would read garbage
+	 * the device itself is brought up in the background, so probe
+	 * returns right away and many devices can come up in parallel
 	 */
-	retval = device_create_file(&interface->dev, &dev_attr_temperature);
-	if (retval)
-		goto error;
+	start_bringup(gdev);
+
+	if (autosuspend) {
+		pm_runtime_set_autosuspend_delay(&udev->dev, idle_timeout_ms);
+		usb_enable_autosuspend(udev);
+	}
+
+	mutex_lock(&gotemp_list_lock);
+	list_add_tail(&gdev->list, &gotemp_list);
+	mutex_unlock(&gotemp_list_lock);
 
-	dev_info(&interface->dev, "USB GoTemp device now attached\n");
+	dev_info(&interface->dev,
+		 "USB GoTemp device now attached to gotemp%u\n", gdev->minor);
 	return 0;
 
 error:
 	usb_set_intfdata(interface, NULL);
 	if (gdev) {
-		usb_free_urb(gdev->int_in_urb);
-		kfree(gdev->int_in_buffer);
+		usb_kill_anchored_urbs(&gdev->int_in_anchor);
+		kref_put(&gdev->kref, gotemp_delete);
 	}
-	kfree(gdev);
 	return retval;
 }
 
@@ -257,40 +3505,245 @@ static void gotemp_disconnect(struct usb_interface *interface)
 
 	gdev = usb_get_intfdata(interface);
 
-	device_remove_file(&interface->dev, &dev_attr_temperature);
+	mutex_lock(&gotemp_list_lock);
+	list_del(&gdev->list);
+	mutex_unlock(&gotemp_list_lock);
+
+	/* give back our minor, no new opens after this */
+	gotemp_chrdev_unregister(gdev);
+
+	/*
+	 * fail the commands and refuse new ones, so neither the bring up
+	 * nor an nv_mem access is stuck waiting on one below
+	 */
+	mutex_lock(&gdev->pm_mutex);
+	WRITE_ONCE(gdev->disconnected, true);
+	mutex_unlock(&gdev->pm_mutex);
+	cmd_cancel_all(gdev);
+
+	sysfs_remove_group(&interface->dev.kobj, &gotemp_attr_group);
+	/* waits for anybody in there, so the counters can go with gdev */
+	debugfs_remove_recursive(gdev->debugfs_dir);
 	/* intfdata must remain valid while reads are under way */
 	usb_set_intfdata(interface, NULL);
 
-	usb_put_dev(gdev->udev);
+	/* stop the bring up, and keep the urbs from restarting it */
+	cancel_delayed_work_sync(&gdev->init_work);
+	stop_urbs(gdev);
+	/* the urbs may have pushed the bring up out once more */
+	cancel_delayed_work_sync(&gdev->init_work);
+	cancel_work_sync(&gdev->alarm_work);
 
-	usb_kill_urb(gdev->int_in_urb);
-	usb_free_urb(gdev->int_in_urb);
-	kfree(gdev->int_in_buffer);
-	kfree(gdev);
+	/* wake up anyone still waiting for samples, they get -ENODEV */
+	wake_up_interruptible_all(&gdev->read_wait);
+
+	/* open files keep gdev around until they are closed */
+	kref_put(&gdev->kref, gotemp_delete);
 
 	dev_info(&interface->dev, "USB GoTemp now disconnected\n");
 }
 
+/*
+ * With nobody reading, tell the device to stop measuring and stop
+ * polling it.  Runtime suspend only comes once the bring up is done,
+ * as it holds a reference until then, but system sleep can interrupt
+ * it, in which case it just starts over on resume.
+ */
+static int gotemp_suspend(struct usb_interface *interface,
+			  pm_message_t message)
+{
+	struct gotemp *gdev = usb_get_intfdata(interface);
+	int retval;
+
+	if (!gdev)
+		return 0;
+
+	cancel_delayed_work_sync(&gdev->init_work);
+	switch (READ_ONCE(gdev->state)) {
+	case GOTEMP_STATE_RUNNING:
+		retval = send_cmd(gdev, CMD_ID_STOP_MEASUREMENTS, NULL, 0);
+		if (retval)
+			dev_dbg(&interface->dev,
+				"Error %d stopping measurements\n", retval);
+		break;
+	case GOTEMP_STATE_FLUSHING:
+		WRITE_ONCE(gdev->state, GOTEMP_STATE_INIT);
+		break;
+	default:
+		break;
+	}
+
+	stop_urbs(gdev);
+	/* the urbs may have pushed the bring up out once more */
+	cancel_delayed_work_sync(&gdev->init_work);
+	return 0;
+}
+
+/* neither the clock model nor the counter survive a break */
+static void forget_stream(struct gotemp *gdev)
+{
+	spin_lock_irq(&gdev->lock);
+	gdev->ts_synced = false;
+	gdev->have_counter = false;
+	gdev->adapt_primed = false;
+	spin_unlock_irq(&gdev->lock);
+}
+
+static int gotemp_resume(struct usb_interface *interface)
+{
+	struct gotemp *gdev = usb_get_intfdata(interface);
+	int retval;
+
+	if (!gdev)
+		return 0;
+
+	forget_stream(gdev);
+
+	switch (READ_ONCE(gdev->state)) {
+	case GOTEMP_STATE_RUNNING:
+		/* don't wait for it, the first packet says it worked */
+		retval = start_urbs(gdev, GFP_NOIO);
+		if (!retval)
+			retval = send_cmd_async(gdev, CMD_ID_START_MEASUREMENTS,
+						NULL, 0, 0, NULL);
+		if (!retval)
+			break;
+		dev_err(&interface->dev,
+			"Error %d restarting measurements\n", retval);
+		stop_urbs(gdev);
+		fallthrough;
+	case GOTEMP_STATE_INIT:
+		start_bringup(gdev);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* the device forgot everything, so bring it up from scratch */
+static int gotemp_reset_resume(struct usb_interface *interface)
+{
+	struct gotemp *gdev = usb_get_intfdata(interface);
+
+	if (gdev)
+		WRITE_ONCE(gdev->state, GOTEMP_STATE_INIT);
+	return gotemp_resume(interface);
+}
+
+/*
+ * The device is about to be reset, by urb_error() giving up on it or by
+ * anybody else.  Stop everything, like for a suspend, minus telling the
+ * device anything.
+ */
+static int gotemp_pre_reset(struct usb_interface *interface)
+{
+	struct gotemp *gdev = usb_get_intfdata(interface);
+
+	if (!gdev)
+		return 0;
+
+	cancel_delayed_work_sync(&gdev->init_work);
+	stop_urbs(gdev);
+	/* the urbs may have pushed the bring up out once more */
+	cancel_delayed_work_sync(&gdev->init_work);
+	return 0;
+}
+
+/* and it is back, knowing nothing, so bring it up from scratch */
+static int gotemp_post_reset(struct usb_interface *interface)
+{
+	struct gotemp *gdev = usb_get_intfdata(interface);
+
+	if (!gdev)
+		return 0;
+
+	forget_stream(gdev);
+	spin_lock_irq(&gdev->lock);
+	gdev->reset_queued = false;
+	gdev->clear_halt = false;
+	spin_unlock_irq(&gdev->lock);
+	WRITE_ONCE(gdev->retries, 0);
+
+	start_bringup(gdev);
+	return 0;
+}
+
 static struct usb_driver gotemp_driver = {
 	.name =		"gotemp",
 	.probe =	gotemp_probe,
 	.disconnect =	gotemp_disconnect,
+	.suspend =	gotemp_suspend,
+	.resume =	gotemp_resume,
+	.reset_resume =	gotemp_reset_resume,
+	.pre_reset =	gotemp_pre_reset,
+	.post_reset =	gotemp_post_reset,
 	.id_table =	id_table,
+	.supports_autosuspend = 1,
 };
 
 static int __init gotemp_init(void)
 {
 	int retval = 0;
 
+	retval = alloc_chrdev_region(&gotemp_devt, 0, GOTEMP_MAX_DEVICES,
+				     "gotemp");
+	if (retval) {
+		pr_err("alloc_chrdev_region failed. Error number %d\n",
+		       retval);
+		return retval;
+	}
+
+	/* one cdev for all of them, gotemp_open() looks up the device */
+	cdev_init(&gotemp_cdev, &gotemp_fops);
+	gotemp_cdev.owner = THIS_MODULE;
+	retval = cdev_add(&gotemp_cdev, gotemp_devt, GOTEMP_MAX_DEVICES);
+	if (retval) {
+		pr_err("cdev_add failed. Error number %d\n", retval);
+		goto error_region;
+	}
+
+	retval = class_register(&gotemp_chrdev_class);
+	if (retval) {
+		pr_err("class_register failed. Error number %d\n", retval);
+		goto error_cdev;
+	}
+
+	retval = misc_register(&snapshot_dev);
+	if (retval) {
+		pr_err("misc_register failed. Error number %d\n", retval);
+		goto error_class;
+	}
+
+	gotemp_debugfs_root = debugfs_create_dir("gotemp", NULL);
+
 	retval = usb_register(&gotemp_driver);
-	if (retval)
-		err("usb_register failed. Error number %d", retval);
+	if (retval) {
+		pr_err("usb_register failed. Error number %d\n", retval);
+		goto error_misc;
+	}
+	return 0;
+
+error_misc:
+	debugfs_remove_recursive(gotemp_debugfs_root);
+	misc_deregister(&snapshot_dev);
+error_class:
+	class_unregister(&gotemp_chrdev_class);
+error_cdev:
+	cdev_del(&gotemp_cdev);
+error_region:
+	unregister_chrdev_region(gotemp_devt, GOTEMP_MAX_DEVICES);
 	return retval;
 }
 
 static void __exit gotemp_exit(void)
 {
 	usb_deregister(&gotemp_driver);
+	debugfs_remove_recursive(gotemp_debugfs_root);
+	misc_deregister(&snapshot_dev);
+	class_unregister(&gotemp_chrdev_class);
+	cdev_del(&gotemp_cdev);
+	unregister_chrdev_region(gotemp_devt, GOTEMP_MAX_DEVICES);
 }
 
 module_init(gotemp_init);
@@ -0,0 +1,109 @@
+/*
+ * USB GoTemp driver - userspace interface
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ */
+
+#ifndef __GOTEMP_H
+#define __GOTEMP_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Every sample the driver decodes is stored as one of these records.
+ * A read() of /dev/gotempN returns a whole number of them, oldest first,
+ * so the buffer passed to read() must hold at least one record.
+ */
+struct gotemp_sample {
+	__u64	timestamp_ns;		/* when it was measured */
+	__u64	arrival_ns;		/* when its packet reached the host */
+	__u32	sequence;		/* increments by one every sample */
+	__s16	raw;			/* 1/128 degree C per count */
+	__u8	rolling_counter;	/* counter of the packet it came in */
+	__u8	flags;			/* GOTEMP_SAMPLE_* */
+	__s32	mdeg;			/* calibrated, in millidegrees C */
+	__u32	reserved;
+};
+
+/*
+ * Both timestamps are CLOCK_BOOTTIME.  timestamp_ns is reconstructed from
+ * the device's measurement period and rolling counter, so it does not
+ * have the USB scheduling jitter arrival_ns has, and never goes backwards.
+ *
+ * mdeg uses the calibration stored in the probe when it has a usable
+ * one, and the nominal raw * 1000 / 128 when it does not.
+ */
+
+/* samples were dropped before this one because the reader fell behind */
+#define GOTEMP_SAMPLE_OVERRUN		0x01
+/* the device sent packets that never reached us before this sample */
+#define GOTEMP_SAMPLE_GAP		0x02
+
+/*
+ * The sample ring can also be mapped read-only with mmap() at offset 0.
+ * The mapping starts with this header, followed by ring_size records
+ * starting data_offset bytes in.  Sample number "seq" lives in record
+ * (seq & (ring_size - 1)).
+ *
+ * The driver is the only writer.  It fills in a record and only then
+ * advances head with release semantics, and it makes sure that new head
+ * is visible before it starts overwriting the oldest record, so a
+ * consumer does:
+ *
+ *	head = load_acquire(&hdr->head);
+ *	if (head - pos > ring_size - 1)
+ *		pos = head - (ring_size - 1);	(fell behind, lost some)
+ *	while (pos != head) {
+ *		copy record (pos & (ring_size - 1));
+ *		read fence;
+ *		if (load(&hdr->head) - pos >= ring_size)
+ *			the copy may be torn, start over;
+ *		pos++;
+ *	}
+ *
+ * The read fence (smp_rmb(), atomic_thread_fence(memory_order_acquire)
+ * in C11) keeps the loads of the copy from moving after the second load
+ * of head, without it a weakly ordered cpu can hand out a record that
+ * was overwritten while it was being copied.
+ *
+ * The record after head is the one being overwritten next, which is why
+ * only ring_size - 1 records are safe to read.  Any number of consumers
+ * can share the mapping since none of them write to it.
+ *
+ * To sleep until new samples show up, tell the driver how far you got
+ * with GOTEMP_IOC_SET_POS and then poll() the file as usual.
+ */
+struct gotemp_ring_header {
+	__u32	magic;			/* GOTEMP_RING_MAGIC */
+	__u16	version;		/* GOTEMP_RING_VERSION */
+	__u16	record_size;		/* sizeof(struct gotemp_sample) */
+	__u32	ring_size;		/* number of records, a power of two */
+	__u32	data_offset;		/* where the records start */
+	__u32	head;			/* sequence of the next sample */
+};
+
+#define GOTEMP_RING_MAGIC		0x676f7470	/* "gotp" */
+#define GOTEMP_RING_VERSION		3
+
+#define GOTEMP_IOC_MAGIC		'G'
+/* set the position read() and poll() work from to a sample sequence */
+#define GOTEMP_IOC_SET_POS		_IOW(GOTEMP_IOC_MAGIC, 0, __u32)
+
+/*
+ * On /dev/gotemp_snapshot: which /dev/gotempN the probe with this serial
+ * number is, or ENOENT.  The serial is what the serial file of the
+ * device in /sys/class/gotemp/ shows, in hex.
+ */
+struct gotemp_serial_lookup {
+	__u64	serial;			/* in */
+	__u32	minor;			/* out, the N of /dev/gotempN */
+	__u32	reserved;
+};
+#define GOTEMP_IOC_FIND_SERIAL		_IOWR(GOTEMP_IOC_MAGIC, 1, \
+					      struct gotemp_serial_lookup)
+
+#endif
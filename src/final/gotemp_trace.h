@@ -0,0 +1,101 @@
+/*
+ * USB GoTemp driver - tracepoints
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gotemp
+
+#if !defined(__GOTEMP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __GOTEMP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+TRACE_EVENT(gotemp_urb_complete,
+	TP_PROTO(struct urb *urb),
+	TP_ARGS(urb),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&urb->dev->dev))
+		__field(int, status)
+		__dynamic_array(u8, data, urb->actual_length)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->status = urb->status;
+		memcpy(__get_dynamic_array(data), urb->transfer_buffer,
+		       urb->actual_length);
+	),
+	TP_printk("%s status=%d data=%s", __get_str(dev), __entry->status,
+		  __print_hex(__get_dynamic_array(data),
+			      __get_dynamic_array_len(data)))
+);
+
+TRACE_EVENT(gotemp_sample,
+	TP_PROTO(struct device *dev, u32 sequence, s16 raw,
+		 u8 rolling_counter, u8 flags),
+	TP_ARGS(dev, sequence, raw, rolling_counter, flags),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u32, sequence)
+		__field(s16, raw)
+		__field(u8, rolling_counter)
+		__field(u8, flags)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->sequence = sequence;
+		__entry->raw = raw;
+		__entry->rolling_counter = rolling_counter;
+		__entry->flags = flags;
+	),
+	TP_printk("%s seq=%u raw=%d counter=%u flags=0x%02x",
+		  __get_str(dev), __entry->sequence, __entry->raw,
+		  __entry->rolling_counter, __entry->flags)
+);
+
+TRACE_EVENT(gotemp_cmd,
+	TP_PROTO(struct device *dev, u8 cmd, int retval),
+	TP_ARGS(dev, cmd, retval),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u8, cmd)
+		__field(int, retval)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->cmd = cmd;
+		__entry->retval = retval;
+	),
+	TP_printk("%s cmd=0x%02x retval=%d", __get_str(dev), __entry->cmd,
+		  __entry->retval)
+);
+
+TRACE_EVENT(gotemp_error,
+	TP_PROTO(struct device *dev, const char *what, int error),
+	TP_ARGS(dev, what, error),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__string(what, what)
+		__field(int, error)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__assign_str(what);
+		__entry->error = error;
+	),
+	TP_printk("%s %s error=%d", __get_str(dev), __get_str(what),
+		  __entry->error)
+);
+
+#endif /* __GOTEMP_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gotemp_trace
+#include <trace/define_trace.h>